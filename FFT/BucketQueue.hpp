@@ -0,0 +1,139 @@
+#pragma once
+#include <queue>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// index of the lowest set bit, value must not be 0
+inline size_t count_trailing_zeros(uint64_t value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+	return __builtin_ctzll(value);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return index;
+#else
+	size_t index = 0;
+	while (!(value & 1))
+	{
+		value >>= 1;
+		++index;
+	}
+	return index;
+#endif
+}
+
+// Priority queue with a fixed number of levels and a FIFO per level.
+// A bitmap of non-empty levels makes add and getMin O(1): the smallest
+// non-empty level is the lowest set bit. Bits change only under the lock
+// of their level, so a set bit means the level had tasks a moment ago.
+template<class T>
+class BucketQueue
+{
+public:
+	static const size_t LEVELS_COUNT = 64;
+
+private:
+	struct Level
+	{
+		mutable std::mutex mutex;
+		std::queue<T> items;
+		// levels are touched by different threads
+		char padding[64];
+	};
+
+	std::atomic<uint64_t> nonEmptyLevels;
+	Level levels[LEVELS_COUNT];
+
+	static uint64_t bit(size_t level)
+	{
+		return uint64_t(1) << level;
+	}
+
+public:
+	BucketQueue() :
+		nonEmptyLevels(0)
+	{
+	}
+
+	// level must be less than LEVELS_COUNT
+	void add(T item, size_t level)
+	{
+		Level & target = levels[level];
+		std::lock_guard<std::mutex> lock(target.mutex);
+		target.items.push(std::move(item));
+		if (target.items.size() == 1)
+		{
+			nonEmptyLevels.fetch_or(bit(level));
+		}
+	}
+
+	// one lock for the whole batch
+	void addAll(std::vector<T> & items, size_t level)
+	{
+		if (items.empty())
+		{
+			return;
+		}
+
+		Level & target = levels[level];
+		std::lock_guard<std::mutex> lock(target.mutex);
+		for (auto & item : items)
+		{
+			target.items.push(std::move(item));
+		}
+		nonEmptyLevels.fetch_or(bit(level));
+	}
+
+	// takes the oldest item of the smallest non-empty level
+	bool getMin(T & result)
+	{
+		uint64_t candidates = nonEmptyLevels.load();
+		while (candidates != 0)
+		{
+			size_t level = count_trailing_zeros(candidates);
+			Level & source = levels[level];
+			{
+				std::lock_guard<std::mutex> lock(source.mutex);
+				if (!source.items.empty())
+				{
+					result = std::move(source.items.front());
+					source.items.pop();
+					if (source.items.empty())
+					{
+						nonEmptyLevels.fetch_and(~bit(level));
+					}
+					return true;
+				}
+			}
+
+			// emptied by another thread after we read the bitmap
+			candidates &= ~bit(level);
+		}
+		return false;
+	}
+
+	bool empty() const
+	{
+		return nonEmptyLevels.load() == 0;
+	}
+
+	// locks every level, meant for monitoring
+	size_t size() const
+	{
+		size_t result = 0;
+		for (auto & level : levels)
+		{
+			std::lock_guard<std::mutex> lock(level.mutex);
+			result += level.items.size();
+		}
+		return result;
+	}
+};
@@ -3,8 +3,8 @@
 #include <cmath>
 #include <thread>
 #include <functional>
-#include <boost/thread/future.hpp>
-#include <boost/thread.hpp>
+
+#include "ThreadPool.hpp"
 
 typedef std::complex<long double> base;
 const double PI = 4 * atan(1);
@@ -37,13 +37,12 @@ std::vector<base> bit_reverse_copy(const std::vector<T> & array)
 	return result;
 }
 
-template<class Func>
-void parallel_process(size_t begin, size_t end, Func func, size_t step)
+template<class Pool, class Func>
+void parallel_process(Pool & pool, size_t begin, size_t end, Func func, size_t step)
 {
 	size_t length = end - begin;
 	size_t items_to_work = length / step;
-	size_t thread_count = std::thread::hardware_concurrency();
-	thread_count = thread_count == 0 ? 2 : thread_count;
+	size_t thread_count = pool.size() + 1;
 
 	auto applier = [&](size_t _begin, size_t _end)
 	{
@@ -59,16 +58,14 @@ void parallel_process(size_t begin, size_t end, Func func, size_t step)
 	}
 	else
 	{
-		std::vector<boost::unique_future<void>> futures;
 		size_t block_size = (items_to_work + 0.5 * thread_count) / thread_count;
 
-		for (size_t index = 0; index < thread_count - 1; ++index)
+		auto futures = pool.runAsyncRange(thread_count - 1, traced("parallel_process", [&](size_t index)
 		{
 			size_t _begin = begin + index * block_size * step;
 			size_t _end = _begin + block_size * step;
-			auto binded_applier = std::bind(applier, _begin, _end);
-			futures.push_back(boost::async(binded_applier));
-		}
+			applier(_begin, _end);
+		}));
 
 		size_t _begin = begin + (thread_count - 1) * block_size * step;
 		size_t _end = length;
@@ -84,8 +81,8 @@ void parallel_process(size_t begin, size_t end, Func func, size_t step)
 	}
 }
 
-template<class T>
-void fft(std::vector<T> & array, bool invert)
+template<class Pool, class T>
+void fft(Pool & pool, std::vector<T> & array, bool invert)
 {
 	if (array.empty())
 	{
@@ -117,7 +114,7 @@ void fft(std::vector<T> & array, bool invert)
 		base wlen(cos(angle), sin(angle));
 
 		auto binded_applier = std::bind(applier, len, wlen, std::placeholders::_1);
-		parallel_process(0, array_length, binded_applier, len);
+		parallel_process(pool, 0, array_length, binded_applier, len);
 	}
 	if (invert)
 	{
@@ -126,12 +123,18 @@ void fft(std::vector<T> & array, bool invert)
 			rev_array[index] /= array_length;
 		};
 
-		parallel_process(0, array_length, applier, 1);
+		parallel_process(pool, 0, array_length, applier, 1);
 	}
 
 	std::swap(array, rev_array);
 }
 
+template<class T>
+void fft(std::vector<T> & array, bool invert)
+{
+	fft(defaultThreadPool(), array, invert);
+}
+
 template<class T>
 void fft_simple(std::vector<T> & a, bool invert) 
 {
@@ -0,0 +1,179 @@
+#pragma once
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <climits>
+#include <cstdint>
+#include <algorithm>
+
+// Relaxed concurrent priority queue: queuesCount sequential heaps behind try-locks.
+// add pushes to a random heap, getMin locks the best of popChoices random heaps,
+// comparing their cached tops without locking. The result is close to the minimum
+// (rank error grows with queuesCount and shrinks with popChoices) but threads rarely
+// touch the same lock. Smaller priorities come first, as in PriorityQueue.
+template<class T>
+class MultiQueue
+{
+private:
+	// wider than any priority, so a heap with INT_MAX on top does not look empty
+	static const int64_t EMPTY = INT64_MAX;
+
+	struct Item
+	{
+		int priority;
+		T item;
+
+		bool operator<(const Item & other) const
+		{
+			// std heap functions build a max heap
+			return priority > other.priority;
+		}
+	};
+
+	struct Heap
+	{
+		std::mutex mutex;
+		std::vector<Item> items;
+		// priority of items.front() or EMPTY, read without the lock
+		std::atomic<int64_t> top;
+		char padding[64];
+
+		Heap() :
+			top(EMPTY)
+		{
+		}
+
+		void push(T && item, int priority)
+		{
+			Item value = { priority, std::move(item) };
+			items.push_back(std::move(value));
+			std::push_heap(items.begin(), items.end());
+			top = items.front().priority;
+		}
+
+		void pop(T & result)
+		{
+			std::pop_heap(items.begin(), items.end());
+			result = std::move(items.back().item);
+			items.pop_back();
+			top = items.empty() ? EMPTY : items.front().priority;
+		}
+	};
+
+	std::vector<std::unique_ptr<Heap>> heaps;
+	size_t popChoices;
+
+	size_t randomHeap()
+	{
+		// xorshift
+		static thread_local uint32_t seed = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&seed)) | 1;
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed % heaps.size();
+	}
+
+public:
+	MultiQueue(size_t queuesCount, size_t popChoices = 2) :
+		popChoices(std::max<size_t>(popChoices, 1))
+	{
+		for (size_t index = 0; index < std::max<size_t>(queuesCount, 1); ++index)
+		{
+			heaps.emplace_back(new Heap());
+		}
+	}
+
+	void add(T item, int priority)
+	{
+		while (true)
+		{
+			Heap & heap = *heaps[randomHeap()];
+			std::unique_lock<std::mutex> lock(heap.mutex, std::try_to_lock);
+			if (lock.owns_lock())
+			{
+				heap.push(std::move(item), priority);
+				return;
+			}
+		}
+	}
+
+	bool getMin(T & result)
+	{
+		// relaxed pops from the best of a few random heaps
+		for (size_t attempt = 0; attempt < heaps.size(); ++attempt)
+		{
+			size_t best = randomHeap();
+			int64_t bestTop = heaps[best]->top.load();
+			for (size_t choice = 1; choice < popChoices; ++choice)
+			{
+				size_t candidate = randomHeap();
+				int64_t candidateTop = heaps[candidate]->top.load();
+				if (candidateTop < bestTop)
+				{
+					best = candidate;
+					bestTop = candidateTop;
+				}
+			}
+
+			if (bestTop == EMPTY)
+			{
+				continue;
+			}
+
+			Heap & heap = *heaps[best];
+			std::unique_lock<std::mutex> lock(heap.mutex, std::try_to_lock);
+			if (lock.owns_lock() && !heap.items.empty())
+			{
+				heap.pop(result);
+				return true;
+			}
+		}
+
+		// random choices missed, make sure every heap is empty before giving up
+		for (auto & heap : heaps)
+		{
+			if (heap->top.load() == EMPTY)
+			{
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(heap->mutex);
+			if (!heap->items.empty())
+			{
+				heap->pop(result);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool empty() const
+	{
+		for (auto & heap : heaps)
+		{
+			if (heap->top.load() != EMPTY)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// locks every heap, meant for monitoring
+	size_t size() const
+	{
+		size_t result = 0;
+		for (auto & heap : heaps)
+		{
+			std::lock_guard<std::mutex> lock(heap->mutex);
+			result += heap->items.size();
+		}
+		return result;
+	}
+
+	size_t queuesCount() const
+	{
+		return heaps.size();
+	}
+};
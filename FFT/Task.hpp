@@ -0,0 +1,359 @@
+#pragma once
+#include <new>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <iterator>
+#include <utility>
+#include <exception>
+#include <stdexcept>
+#include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "Future.hpp"
+
+// Move-only replacement for std::function<void()>.
+// Functors up to INLINE_SIZE bytes are stored inside the task itself,
+// bigger ones fall back to a single heap allocation.
+class Task
+{
+private:
+	static const size_t INLINE_SIZE = 64;
+
+	struct Operations
+	{
+		void (*invoke)(void * storage);
+		void (*move)(void * from, void * to);
+		void (*destroy)(void * storage);
+	};
+
+	template<class Fn>
+	struct InlineOperations
+	{
+		static void invoke(void * storage)
+		{
+			(*static_cast<Fn *>(storage))();
+		}
+
+		static void move(void * from, void * to)
+		{
+			new (to) Fn(std::move(*static_cast<Fn *>(from)));
+			static_cast<Fn *>(from)->~Fn();
+		}
+
+		static void destroy(void * storage)
+		{
+			static_cast<Fn *>(storage)->~Fn();
+		}
+
+		static const Operations * get()
+		{
+			static const Operations operations = { &invoke, &move, &destroy };
+			return &operations;
+		}
+	};
+
+	template<class Fn>
+	struct HeapOperations
+	{
+		static Fn *& pointer(void * storage)
+		{
+			return *static_cast<Fn **>(storage);
+		}
+
+		static void invoke(void * storage)
+		{
+			(*pointer(storage))();
+		}
+
+		static void move(void * from, void * to)
+		{
+			new (to) Fn *(pointer(from));
+		}
+
+		static void destroy(void * storage)
+		{
+			delete pointer(storage);
+		}
+
+		static const Operations * get()
+		{
+			static const Operations operations = { &invoke, &move, &destroy };
+			return &operations;
+		}
+	};
+
+	template<class Fn>
+	struct IsInline
+	{
+		static const bool value = sizeof(Fn) <= INLINE_SIZE
+			&& alignof(Fn) <= alignof(std::max_align_t)
+			&& std::is_nothrow_move_constructible<Fn>::value;
+	};
+
+	typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type storage;
+	const Operations * operations;
+	// creation time for enqueue-to-start latency, 0 unless some pool collects stats
+	int64_t createdAt;
+	// a full pool may drop it to make room, see OverflowPolicy::DropNext
+	bool canDrop;
+
+	static std::atomic<int> & timestampUsers()
+	{
+		static std::atomic<int> users(0);
+		return users;
+	}
+
+	template<class Fn>
+	void init(Fn && fn, std::true_type)
+	{
+		typedef typename std::decay<Fn>::type F;
+		new (&storage) F(std::forward<Fn>(fn));
+		operations = InlineOperations<F>::get();
+	}
+
+	template<class Fn>
+	void init(Fn && fn, std::false_type)
+	{
+		typedef typename std::decay<Fn>::type F;
+		new (&storage) F *(new F(std::forward<Fn>(fn)));
+		operations = HeapOperations<F>::get();
+	}
+
+	void reset()
+	{
+		if (operations)
+		{
+			operations->destroy(&storage);
+			operations = nullptr;
+		}
+	}
+
+public:
+	Task() :
+		operations(nullptr),
+		createdAt(0),
+		canDrop(false)
+	{
+	}
+
+	template<class Fn, class = typename std::enable_if<
+		!std::is_same<typename std::decay<Fn>::type, Task>::value>::type>
+	Task(Fn && fn) :
+		operations(nullptr),
+		createdAt(timestampUsers().load(std::memory_order_relaxed) > 0 ? now() : 0),
+		canDrop(false)
+	{
+		init(std::forward<Fn>(fn), std::integral_constant<bool, IsInline<typename std::decay<Fn>::type>::value>());
+	}
+
+	Task(Task && other) :
+		operations(other.operations),
+		createdAt(other.createdAt),
+		canDrop(other.canDrop)
+	{
+		if (operations)
+		{
+			operations->move(&other.storage, &storage);
+			other.operations = nullptr;
+		}
+	}
+
+	Task & operator=(Task && other)
+	{
+		if (this != &other)
+		{
+			reset();
+			if (other.operations)
+			{
+				other.operations->move(&other.storage, &storage);
+				operations = other.operations;
+				other.operations = nullptr;
+			}
+			createdAt = other.createdAt;
+			canDrop = other.canDrop;
+		}
+		return *this;
+	}
+
+	Task(const Task &) = delete;
+	Task & operator=(const Task &) = delete;
+
+	~Task()
+	{
+		reset();
+	}
+
+	void operator()()
+	{
+		operations->invoke(&storage);
+	}
+
+	explicit operator bool() const
+	{
+		return operations != nullptr;
+	}
+
+	int64_t creationTime() const
+	{
+		return createdAt;
+	}
+
+	bool isDroppable() const
+	{
+		return canDrop;
+	}
+
+	void allowDrop()
+	{
+		canDrop = true;
+	}
+
+	// steady clock in nanoseconds
+	static int64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// new tasks record their creation time while at least one user is registered
+	static void addTimestampUser()
+	{
+		++timestampUsers();
+	}
+
+	static void removeTimestampUser()
+	{
+		--timestampUsers();
+	}
+};
+
+// Shared state of a submitted task: the functor lives in the same allocation
+// as the DataContainer of its future.
+template<class R, class Fn>
+class TaskState : public DataContainer<R>
+{
+private:
+	Fn fn;
+
+public:
+	explicit TaskState(Fn && fn) :
+		fn(std::move(fn))
+	{
+	}
+
+	void run()
+	{
+		try
+		{
+			this->set(fn());
+		}
+		catch (const std::exception &)
+		{
+			this->setException(std::current_exception());
+		}
+	}
+};
+
+template<class Fn>
+class TaskState<void, Fn> : public DataContainer<void>
+{
+private:
+	Fn fn;
+
+public:
+	explicit TaskState(Fn && fn) :
+		fn(std::move(fn))
+	{
+	}
+
+	void run()
+	{
+		try
+		{
+			fn();
+			this->set();
+		}
+		catch (const std::exception &)
+		{
+			this->setException(std::current_exception());
+		}
+	}
+};
+
+// The queued part of a submitted task. A task destroyed without running, e.g. dropped
+// by a full pool, completes its future with an exception instead of leaving it pending.
+template<class R, class Fn>
+class TaskRunner
+{
+private:
+	std::shared_ptr<TaskState<R, Fn>> state;
+
+public:
+	explicit TaskRunner(std::shared_ptr<TaskState<R, Fn>> state) :
+		state(std::move(state))
+	{
+	}
+
+	TaskRunner(TaskRunner && other) = default;
+
+	~TaskRunner()
+	{
+		if (state && !state->ready())
+		{
+			state->setException(std::runtime_error("task was dropped before it ran"));
+		}
+	}
+
+	void operator()()
+	{
+		state->run();
+	}
+};
+
+// Builds a task for the queue and the future bound to it with one allocation.
+template<class Fn>
+Future<typename std::result_of<Fn()>::type> make_task(Fn fn, Task & task)
+{
+	typedef typename std::result_of<Fn()>::type R;
+
+	auto state = std::make_shared<TaskState<R, Fn>>(std::move(fn));
+	task = Task(TaskRunner<R, Fn>(state));
+	return Future<R>(state);
+}
+
+template<class InputIt>
+struct BulkResult
+{
+	typedef typename std::result_of<typename std::iterator_traits<InputIt>::value_type()>::type type;
+};
+
+// Builds one task per functor in [first, last).
+template<class InputIt>
+std::vector<Future<typename BulkResult<InputIt>::type>> make_tasks(InputIt first, InputIt last, std::vector<Task> & tasks)
+{
+	std::vector<Future<typename BulkResult<InputIt>::type>> futures;
+	for (; first != last; ++first)
+	{
+		tasks.emplace_back();
+		futures.push_back(make_task(*first, tasks.back()));
+	}
+	return futures;
+}
+
+// Builds count tasks calling fn(index).
+template<class Fn>
+std::vector<Future<typename std::result_of<Fn(size_t)>::type>> make_range_tasks(size_t count, Fn fn, std::vector<Task> & tasks)
+{
+	std::vector<Future<typename std::result_of<Fn(size_t)>::type>> futures;
+	futures.reserve(count);
+	tasks.reserve(tasks.size() + count);
+	for (size_t index = 0; index < count; ++index)
+	{
+		tasks.emplace_back();
+		futures.push_back(make_task([fn, index]() mutable { return fn(index); }, tasks.back()));
+	}
+	return futures;
+}
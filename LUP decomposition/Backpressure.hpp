@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// What a bounded pool does with a new task while capacity tasks are already queued,
+// see ThreadPool::setCapacity.
+enum class OverflowPolicy
+{
+	// the producer waits until a worker takes a task, on a worker thread the task runs in the caller instead
+	Block,
+	// the task is not queued, its future gets an exception
+	FailFast,
+	// the submitting thread runs the task itself
+	CallerRuns,
+	// The task the strategy would hand out next to the submitting thread is discarded to make room,
+	// its future gets an exception. That is the oldest task of a FIFO queue, the most urgent one
+	// of a priority queue and the newest task of its own deque on a work-stealing worker.
+	// Only tasks of a bounded runAsync or submit are dropped, without one the new task is rejected.
+	DropNext
+};
+
+enum class SubmitStatus
+{
+	Queued,
+	Rejected,
+	RanInCaller
+};
+
+struct BackpressureStats
+{
+	uint64_t queuedCount;
+	// producers that had to wait for room
+	uint64_t blockedCount;
+	uint64_t rejectedCount;
+	uint64_t ranInCallerCount;
+	uint64_t droppedCount;
+};
+
+// Shared by all producers of a pool, only touched while the pool is bounded.
+class BackpressureCounters
+{
+private:
+	char frontPadding[64];
+	std::atomic<uint64_t> queuedCount;
+	std::atomic<uint64_t> blockedCount;
+	std::atomic<uint64_t> rejectedCount;
+	std::atomic<uint64_t> ranInCallerCount;
+	std::atomic<uint64_t> droppedCount;
+	char backPadding[64];
+
+public:
+	BackpressureCounters() :
+		queuedCount(0),
+		blockedCount(0),
+		rejectedCount(0),
+		ranInCallerCount(0),
+		droppedCount(0)
+	{
+	}
+
+	void record(SubmitStatus status)
+	{
+		switch (status)
+		{
+		case SubmitStatus::Queued:
+			queuedCount.fetch_add(1, std::memory_order_relaxed);
+			break;
+		case SubmitStatus::Rejected:
+			rejectedCount.fetch_add(1, std::memory_order_relaxed);
+			break;
+		case SubmitStatus::RanInCaller:
+			ranInCallerCount.fetch_add(1, std::memory_order_relaxed);
+			break;
+		}
+	}
+
+	void producerBlocked()
+	{
+		blockedCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void taskDropped()
+	{
+		droppedCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	BackpressureStats snapshot() const
+	{
+		BackpressureStats stats;
+		stats.queuedCount = queuedCount.load(std::memory_order_relaxed);
+		stats.blockedCount = blockedCount.load(std::memory_order_relaxed);
+		stats.rejectedCount = rejectedCount.load(std::memory_order_relaxed);
+		stats.ranInCallerCount = ranInCallerCount.load(std::memory_order_relaxed);
+		stats.droppedCount = droppedCount.load(std::memory_order_relaxed);
+		return stats;
+	}
+};
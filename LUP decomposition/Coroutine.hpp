@@ -0,0 +1,259 @@
+#pragma once
+// C++20 coroutines on top of ThreadPool, compiled only when the compiler has them
+// (e.g. -std=c++20), so C++11 builds can include this header and get nothing.
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#define THREAD_POOL_COROUTINES
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#include "Task.hpp"
+#include "Future.hpp"
+
+// Posts resumptions of a coroutine to a pool, without knowing its type.
+struct CoroutineScheduler
+{
+	void * pool;
+	void (*schedule)(void * pool, std::coroutine_handle<> handle);
+
+	template<class Pool>
+	static CoroutineScheduler of(Pool & pool)
+	{
+		CoroutineScheduler scheduler = { &pool, [](void * target, std::coroutine_handle<> handle)
+		{
+			post_unbounded(*static_cast<Pool *>(target), Task([handle]() { handle.resume(); }));
+		} };
+		return scheduler;
+	}
+
+	// inline when the coroutine is not bound to a pool
+	void resume(std::coroutine_handle<> handle) const
+	{
+		if (pool)
+		{
+			schedule(pool, handle);
+		}
+		else
+		{
+			handle.resume();
+		}
+	}
+};
+
+template<class T>
+class CoTask;
+
+// state every CoTask coroutine carries in its frame
+class CoPromiseBase
+{
+public:
+	CoroutineScheduler scheduler = { nullptr, nullptr };
+	std::coroutine_handle<> continuation;
+	// started with CoTask::start, nobody owns the frame
+	bool isDetached = false;
+
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept
+		{
+			return false;
+		}
+
+		template<class Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+		{
+			CoPromiseBase & promise = handle.promise();
+			if (promise.continuation)
+			{
+				// straight back to the awaiting coroutine, no trip through the queue
+				return promise.continuation;
+			}
+
+			if (promise.isDetached)
+			{
+				handle.destroy();
+			}
+			return std::noop_coroutine();
+		}
+
+		void await_resume() noexcept
+		{
+		}
+	};
+
+	std::suspend_always initial_suspend() noexcept
+	{
+		return std::suspend_always();
+	}
+
+	FinalAwaiter final_suspend() noexcept
+	{
+		return FinalAwaiter();
+	}
+};
+
+// co_await on a Future suspends the coroutine without blocking the thread,
+// it is resumed on the pool of the awaiting CoTask once the value or the exception is set.
+template<class T>
+class FutureAwaiter
+{
+private:
+	Future<T> future;
+
+public:
+	explicit FutureAwaiter(Future<T> future) :
+		future(std::move(future))
+	{
+	}
+
+	bool await_ready() const
+	{
+		return future.isReady();
+	}
+
+	// the coroutine may be resumed on another worker before this returns,
+	// so the awaiter is not touched after onReady
+	template<class Promise>
+	void await_suspend(std::coroutine_handle<Promise> handle)
+	{
+		CoroutineScheduler scheduler = static_cast<CoPromiseBase &>(handle.promise()).scheduler;
+		Future<T> source = future;
+		source.onReady([scheduler, handle]() { scheduler.resume(handle); });
+	}
+
+	// the value is ready, get() takes the lock-free path
+	decltype(std::declval<Future<T> &>().get()) await_resume()
+	{
+		return future.get();
+	}
+};
+
+template<class T>
+FutureAwaiter<T> operator co_await(Future<T> future)
+{
+	return FutureAwaiter<T>(std::move(future));
+}
+
+template<class T>
+class CoPromise : public CoPromiseBase
+{
+public:
+	Future<T> result;
+
+	CoTask<T> get_return_object();
+
+	void return_value(T value)
+	{
+		result.set(std::move(value));
+	}
+
+	void unhandled_exception()
+	{
+		result.setException(std::current_exception());
+	}
+};
+
+template<>
+class CoPromise<void> : public CoPromiseBase
+{
+public:
+	Future<void> result;
+
+	CoTask<void> get_return_object();
+
+	void return_void()
+	{
+		result.set();
+	}
+
+	void unhandled_exception()
+	{
+		result.setException(std::current_exception());
+	}
+};
+
+// Lazy coroutine producing T. Either start it on a pool, which gives a Future<T>,
+// or co_await it from another CoTask, which runs it on the awaiting thread.
+//
+//   CoTask<int> answer(SimpleThreadPool & pool)
+//   {
+//       int half = co_await pool.runAsync([]() { return 21; });
+//       co_return half * 2;
+//   }
+//   Future<int> result = answer(pool).start(pool);
+template<class T>
+class CoTask
+{
+public:
+	typedef CoPromise<T> promise_type;
+
+private:
+	std::coroutine_handle<promise_type> handle;
+
+public:
+	explicit CoTask(std::coroutine_handle<promise_type> handle) :
+		handle(handle)
+	{
+	}
+
+	CoTask(CoTask && other) noexcept :
+		handle(std::exchange(other.handle, nullptr))
+	{
+	}
+
+	CoTask(const CoTask &) = delete;
+	CoTask & operator=(const CoTask &) = delete;
+
+	~CoTask()
+	{
+		if (handle)
+		{
+			handle.destroy();
+		}
+	}
+
+	// posts the first step to the pool, every resumption after an await of a Future goes there too
+	template<class Pool>
+	Future<T> start(Pool & pool) &&
+	{
+		promise_type & promise = handle.promise();
+		promise.scheduler = CoroutineScheduler::of(pool);
+		promise.isDetached = true;
+		Future<T> result = promise.result;
+		promise.scheduler.resume(std::exchange(handle, nullptr));
+		return result;
+	}
+
+	bool await_ready() const
+	{
+		return false;
+	}
+
+	// the child inherits the pool of the awaiting coroutine
+	template<class Promise>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> awaiting)
+	{
+		handle.promise().scheduler = awaiting.promise().scheduler;
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	decltype(std::declval<Future<T> &>().get()) await_resume()
+	{
+		return handle.promise().result.get();
+	}
+};
+
+template<class T>
+CoTask<T> CoPromise<T>::get_return_object()
+{
+	return CoTask<T>(std::coroutine_handle<CoPromise<T>>::from_promise(*this));
+}
+
+inline CoTask<void> CoPromise<void>::get_return_object()
+{
+	return CoTask<void>(std::coroutine_handle<CoPromise<void>>::from_promise(*this));
+}
+
+#endif
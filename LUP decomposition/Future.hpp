@@ -0,0 +1,433 @@
+#pragma once
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include <type_traits>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+
+// Implemented by thread pools. A worker thread registers its pool here,
+// so that waiting for a future on that thread runs other pending tasks
+// instead of blocking the worker.
+class WaitHelper
+{
+protected:
+	~WaitHelper()
+	{
+	}
+
+public:
+	// runs one pending task, returns false if there was none
+	virtual bool helpOnce() = 0;
+
+	// the current task is about to block and back, see BlockingScope
+	virtual void beginBlocking()
+	{
+	}
+
+	virtual void endBlocking()
+	{
+	}
+
+	static WaitHelper *& current()
+	{
+		static thread_local WaitHelper * helper = nullptr;
+		return helper;
+	}
+};
+
+// state shared by DataContainer<T> and DataContainer<void>
+class DataContainerBase
+{
+private:
+	// set with release after the value or the exception, so a reader
+	// that sees it with acquire needs no lock
+	std::atomic<bool> isReady;
+	std::exception_ptr exception;
+	std::vector<std::function<void()>> continuations;
+
+protected:
+	std::mutex mutex;
+	std::condition_variable condition;
+
+	DataContainerBase() :
+		isReady(false)
+	{
+	}
+
+	void wait(std::unique_lock<std::mutex> & lock)
+	{
+		condition.wait(lock, [this]() -> bool { return ready(); });
+	}
+
+	void rethrow()
+	{
+		if (exception)
+		{
+			std::rethrow_exception(exception);
+		}
+	}
+
+	// waits for the value without the lock if it is already there
+	void waitReady()
+	{
+		if (ready())
+		{
+			rethrow();
+			return;
+		}
+
+		help();
+		std::unique_lock<std::mutex> lock(mutex);
+		wait(lock);
+		rethrow();
+	}
+
+	// on a worker thread runs other tasks until the value is ready
+	void help()
+	{
+		WaitHelper * helper = WaitHelper::current();
+		if (!helper)
+		{
+			return;
+		}
+
+		while (!ready())
+		{
+			if (!helper->helpOnce())
+			{
+				// the awaited task is running somewhere else, check the queue again from time to time
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait_for(lock, std::chrono::microseconds(100), [this]() -> bool { return ready(); });
+			}
+		}
+	}
+
+	// runs the continuations outside of the lock
+	void markReady(std::unique_lock<std::mutex> & lock)
+	{
+		isReady.store(true, std::memory_order_release);
+		std::vector<std::function<void()>> callbacks;
+		callbacks.swap(continuations);
+		lock.unlock();
+
+		condition.notify_all();
+		for (auto & callback : callbacks)
+		{
+			callback();
+		}
+	}
+
+public:
+	bool ready() const
+	{
+		return isReady.load(std::memory_order_acquire);
+	}
+
+	// in a catch block pass std::current_exception(), so get() throws the original type
+	void setException(std::exception_ptr error)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		exception = std::move(error);
+		markReady(lock);
+	}
+
+	template<class E>
+	void setException(const E & e)
+	{
+		setException(std::make_exception_ptr(e));
+	}
+
+	// callback is called once the value or an exception is set,
+	// immediately if it is already there
+	void onReady(std::function<void()> callback)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!ready())
+		{
+			continuations.push_back(std::move(callback));
+			return;
+		}
+
+		lock.unlock();
+		callback();
+	}
+};
+
+template<class T>
+class DataContainer : public DataContainerBase
+{
+private:
+	T data;
+
+public:
+	// valid while the container is alive
+	const T & get()
+	{
+		waitReady();
+		return data;
+	}
+
+	// moves the value out, for the only consumer of the result
+	T take()
+	{
+		waitReady();
+		return std::move(data);
+	}
+
+	void set(const T & data)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		this->data = data;
+		markReady(lock);
+	}
+
+	void set(T && data)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		this->data = std::move(data);
+		markReady(lock);
+	}
+};
+
+// partial specializations for void
+template<>
+class DataContainer<void> : public DataContainerBase
+{
+public:
+	void get()
+	{
+		waitReady();
+	}
+
+	void set()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		markReady(lock);
+	}
+};
+
+template<class T>
+class Future;
+
+// functionality shared by Future<T> and Future<void>
+// Tasks nobody could be told about a rejection of, like continuations, go past the limit of
+// a bounded pool (ThreadPool::postUnbounded). Other executors get a plain post.
+template<class Executor, class Fn>
+auto post_unbounded(Executor & executor, Fn fn, int) -> decltype(executor.postUnbounded(std::move(fn)))
+{
+	executor.postUnbounded(std::move(fn));
+}
+
+template<class Executor, class Fn>
+void post_unbounded(Executor & executor, Fn fn, long)
+{
+	executor.post(std::move(fn));
+}
+
+template<class Executor, class Fn>
+void post_unbounded(Executor & executor, Fn fn)
+{
+	post_unbounded(executor, std::move(fn), 0);
+}
+
+template<class T>
+class FutureBase
+{
+protected:
+	std::shared_ptr<DataContainer<T>> ptr;
+
+	FutureBase(std::shared_ptr<DataContainer<T>> ptr) :
+		ptr(std::move(ptr))
+	{
+	}
+
+public:
+	bool isReady() const
+	{
+		return ptr->ready();
+	}
+
+	void setException(std::exception_ptr error)
+	{
+		ptr->setException(std::move(error));
+	}
+
+	template<class E>
+	void setException(const E & e)
+	{
+		ptr->setException(e);
+	}
+
+	void onReady(std::function<void()> callback)
+	{
+		ptr->onReady(std::move(callback));
+	}
+
+	// Schedules fn(Future<T>) on executor once this future is ready.
+	// Executor is anything with post(Task), e.g. a ThreadPool.
+	template<class Executor, class Fn>
+	Future<typename std::result_of<Fn(Future<T>)>::type> then(Executor & executor, Fn fn)
+	{
+		typedef typename std::result_of<Fn(Future<T>)>::type R;
+
+		Future<R> result;
+		Future<T> source(ptr);
+		Executor * target = &executor;
+		ptr->onReady([target, source, result, fn]()
+		{
+			post_unbounded(*target, [source, result, fn]() mutable
+			{
+				set_result(result, fn, source);
+			});
+		});
+
+		return result;
+	}
+};
+
+template<class T>
+class Future : public FutureBase<T>
+{
+public:
+	Future() :
+		FutureBase<T>(std::make_shared<DataContainer<T>>())
+	{
+	}
+
+	explicit Future(std::shared_ptr<DataContainer<T>> ptr) :
+		FutureBase<T>(std::move(ptr))
+	{
+	}
+
+	// the reference lives as long as some Future of this result
+	const T & get()
+	{
+		return this->ptr->get();
+	}
+
+	// moves the result out, other copies of the future must not read it afterwards
+	T take()
+	{
+		return this->ptr->take();
+	}
+
+	void set(const T & data)
+	{
+		this->ptr->set(data);
+	}
+
+	void set(T && data)
+	{
+		this->ptr->set(std::move(data));
+	}
+};
+
+template<>
+class Future<void> : public FutureBase<void>
+{
+public:
+	Future() :
+		FutureBase<void>(std::make_shared<DataContainer<void>>())
+	{
+	}
+
+	explicit Future(std::shared_ptr<DataContainer<void>> ptr) :
+		FutureBase<void>(std::move(ptr))
+	{
+	}
+
+	void get()
+	{
+		ptr->get();
+	}
+
+	void set()
+	{
+		ptr->set();
+	}
+};
+
+// runs fn(argument) and stores the result or the exception in result
+template<class R, class Fn, class Arg>
+void set_result(Future<R> & result, Fn & fn, Arg & argument)
+{
+	try
+	{
+		result.set(fn(argument));
+	}
+	catch(const std::exception &)
+	{
+		result.setException(std::current_exception());
+	}
+}
+
+template<class Fn, class Arg>
+void set_result(Future<void> & result, Fn & fn, Arg & argument)
+{
+	try
+	{
+		fn(argument);
+		result.set();
+	}
+	catch(const std::exception &)
+	{
+		result.setException(std::current_exception());
+	}
+}
+
+// Ready when every future in the list is ready (with a value or an exception).
+template<class T>
+Future<void> when_all(const std::vector<Future<T>> & futures)
+{
+	Future<void> result;
+	if (futures.empty())
+	{
+		result.set();
+		return result;
+	}
+
+	auto remaining = std::make_shared<std::atomic<size_t>>(futures.size());
+	for (auto future : futures)
+	{
+		future.onReady([remaining, result]() mutable
+		{
+			if (--*remaining == 0)
+			{
+				result.set();
+			}
+		});
+	}
+	return result;
+}
+
+// Ready with the index of the first future in the list that becomes ready,
+// an empty list gives an exception.
+template<class T>
+Future<size_t> when_any(const std::vector<Future<T>> & futures)
+{
+	Future<size_t> result;
+	if (futures.empty())
+	{
+		result.setException(std::invalid_argument("when_any of no futures"));
+		return result;
+	}
+
+	auto isDone = std::make_shared<std::atomic<bool>>(false);
+	for (size_t index = 0; index < futures.size(); ++index)
+	{
+		Future<T> future = futures[index];
+		future.onReady([isDone, result, index]() mutable
+		{
+			if (!isDone->exchange(true))
+			{
+				result.set(index);
+			}
+		});
+	}
+	return result;
+}
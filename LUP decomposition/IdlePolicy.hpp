@@ -0,0 +1,129 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <cstddef>
+#include <cstdint>
+
+#include "EventCount.hpp"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#include <immintrin.h>
+#endif
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+	_mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	asm volatile("yield");
+#endif
+}
+
+// How an idle worker waits for the next task: spin with a pause instruction,
+// then give up its time slice a few times, then park on an EventCount.
+struct IdlePolicy
+{
+	static const size_t DEFAULT_SPIN_COUNT = 128;
+	static const size_t DEFAULT_YIELD_COUNT = 8;
+
+	size_t spinCount;
+	size_t yieldCount;
+
+	IdlePolicy(size_t spinCount = DEFAULT_SPIN_COUNT, size_t yieldCount = DEFAULT_YIELD_COUNT) :
+		spinCount(spinCount),
+		yieldCount(yieldCount)
+	{
+	}
+
+	// park right away
+	static IdlePolicy park()
+	{
+		return IdlePolicy(0, 0);
+	}
+};
+
+class IdleWaiter
+{
+private:
+	IdlePolicy policy;
+	EventCount eventCount;
+
+public:
+	explicit IdleWaiter(const IdlePolicy & policy) :
+		policy(policy)
+	{
+	}
+
+	// Calls tryGet until it succeeds, returns false once it fails on a closed queue.
+	template<class TryGet>
+	bool wait(TryGet tryGet, const std::atomic<bool> & isClosed)
+	{
+		return wait(tryGet, isClosed, []() -> int64_t { return 0; });
+	}
+
+	// Parks for at most parkLimit() nanoseconds at a time, 0 parks until notified. parkLimit is
+	// called after the last tryGet before parking, so it sees what a notifier published before.
+	template<class TryGet, class ParkLimit>
+	bool wait(TryGet tryGet, const std::atomic<bool> & isClosed, ParkLimit parkLimit)
+	{
+		for (size_t index = 0; index < policy.spinCount && !isClosed.load(std::memory_order_relaxed); ++index)
+		{
+			if (tryGet())
+			{
+				return true;
+			}
+			cpu_relax();
+		}
+
+		for (size_t index = 0; index < policy.yieldCount && !isClosed.load(std::memory_order_relaxed); ++index)
+		{
+			if (tryGet())
+			{
+				return true;
+			}
+			std::this_thread::yield();
+		}
+
+		while (true)
+		{
+			if (tryGet())
+			{
+				return true;
+			}
+
+			auto key = eventCount.prepareWait();
+			if (tryGet())
+			{
+				eventCount.cancelWait();
+				return true;
+			}
+
+			if (isClosed.load())
+			{
+				eventCount.cancelWait();
+				return false;
+			}
+
+			int64_t limit = parkLimit();
+			if (limit > 0)
+			{
+				eventCount.waitFor(key, limit);
+			}
+			else
+			{
+				eventCount.wait(key);
+			}
+		}
+	}
+
+	// no syscall unless a worker is parked
+	void notify(size_t tasksCount = 1)
+	{
+		eventCount.notify(tasksCount);
+	}
+
+	void notifyAll()
+	{
+		eventCount.notifyAll();
+	}
+};
@@ -5,8 +5,7 @@
 #include <random>
 #include <stdexcept>
 
-#include <boost/thread.hpp>
-#include <boost/thread/future.hpp>
+#include "ThreadPool.hpp"
 
 template<class T>
 class Matrix
@@ -16,12 +15,12 @@ private:
 	size_t rows;
 	size_t columns;
 
-	friend class Matrix;
+	template<class> friend class Matrix;
 
 	class lu_adapter
 	{
 	private:
-		 Matrix<double>  m;
+		const Matrix<double> & m;
 	public:
 		lu_adapter(const Matrix<double> & m_) :
 			m(m_)
@@ -103,7 +102,8 @@ public:
 		}
 	}
 
-	Matrix<double> lup_decomposition(std::vector<size_t> & perms, size_t thread_count) const
+	template<class Pool>
+	Matrix<double> lup_decomposition(Pool & pool, std::vector<size_t> & perms, size_t thread_count) const
 	{
 		perms.resize(rows);
 		std::iota(perms.begin(), perms.end(), 0);
@@ -145,11 +145,12 @@ public:
 				}
 			};
 			
-			std::vector<boost::unique_future<void>> futures;
-			
-			for (size_t index = 0; index < thread_count - 1; ++index)
+			// the same rows go to the same worker in every phase and stay in its cache,
+			// pools without keyed submission take them in any order
+			std::vector<Future<void>> futures;
+			for (size_t row_index = 0; row_index + 1 < thread_count; ++row_index)
 			{
-				futures.push_back(boost::async(std::bind(row_changer, index)));
+				futures.push_back(run_async_on(pool, row_index, [&, row_index]() { row_changer(row_index); }));
 			}
 
 			row_changer(thread_count - 1);
@@ -163,6 +164,11 @@ public:
 		return result;
 	}
 
+	Matrix<double> lup_decomposition(std::vector<size_t> & perms, size_t thread_count) const
+	{
+		return lup_decomposition(defaultThreadPool(), perms, thread_count);
+	}
+
 	std::vector<double> solve_slu(const Matrix<T> & b)
 	{
 		std::vector<size_t> perms;
@@ -49,6 +49,27 @@ BOOST_AUTO_TEST_CASE(lup_test)
 	}
 }
 
+BOOST_AUTO_TEST_CASE(lup_pool_test)
+{
+	const size_t matrix_size = 50;
+	Matrix<double> m = Matrix<double>::random(matrix_size, matrix_size);
+
+	// keyed submission on the default pool, plain runAsync on a FIFO one
+	std::vector<size_t> perm, simple_perm;
+	auto keyed = m.lup_decomposition(perm, 4);
+	SimpleThreadPool pool(2);
+	auto simple = m.lup_decomposition(pool, simple_perm, 4);
+
+	BOOST_REQUIRE(perm == simple_perm);
+	for (size_t row = 0; row < matrix_size; ++row)
+	{
+		for (size_t column = 0; column < matrix_size; ++column)
+		{
+			BOOST_REQUIRE(abs(keyed.at(row, column) - simple.at(row, column)) < 0.00001);
+		}
+	}
+}
+
 BOOST_AUTO_TEST_CASE(slu_test)
 {
 	const size_t matrix_size = 100;
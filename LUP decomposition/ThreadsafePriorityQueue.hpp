@@ -0,0 +1,290 @@
+#pragma once
+#include <queue>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <boost/thread.hpp>
+
+#include "Future.hpp"
+
+//#define DEBUG
+
+#ifdef DEBUG
+#define D(a) std::cout << a << std::endl;
+#else
+#define D(a) ;
+#endif
+
+// Concurrent heap of Hunt et al.: a short global lock only reserves the slot,
+// add sifts up with hand-over-hand node locks while getMin sifts down.
+// A node inserted by a thread is tagged with its id until it settles,
+// so the inserter can follow it when a concurrent getMin moves it.
+// Smaller priorities come first.
+template<class T, class Priority = int>
+class PriorityQueue
+{
+private:
+	static const size_t EMPTY = 0;
+	static const size_t AVAILABLE = 1;
+	static const size_t MAX_LEVELS = 48;
+	static const size_t DEFAULT_CAPACITY = 1024;
+
+	typedef boost::detail::spinlock SpinLock;
+
+	struct Node
+	{
+		SpinLock lock;
+		size_t tag;
+		Priority priority;
+		T item;
+
+		Node() :
+			lock(),
+			tag(EMPTY),
+			priority()
+		{
+		}
+	};
+
+	// level k holds nodes [2^k, 2^(k+1)), levels are never moved once allocated
+	std::atomic<Node *> levels[MAX_LEVELS];
+	std::atomic<size_t> levelsCount;
+
+	std::mutex heapLock;
+	std::atomic<size_t> count;
+
+	static size_t levelOf(size_t index)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(index);
+#else
+		size_t level = 0;
+		while (index >>= 1)
+		{
+			++level;
+		}
+		return level;
+#endif
+	}
+
+	// indices start at 1
+	Node & node(size_t index)
+	{
+		size_t level = levelOf(index);
+		return levels[level].load(std::memory_order_acquire)[index - (size_t(1) << level)];
+	}
+
+	bool exists(size_t index) const
+	{
+		return levelOf(index) < levelsCount.load(std::memory_order_acquire);
+	}
+
+	// must be called with heapLock held
+	void reserve(size_t index)
+	{
+		while (!exists(index))
+		{
+			size_t level = levelsCount.load(std::memory_order_relaxed);
+			levels[level].store(new Node[size_t(1) << level], std::memory_order_release);
+			levelsCount.store(level + 1, std::memory_order_release);
+		}
+	}
+
+	static size_t currentTag()
+	{
+		static std::atomic<size_t> nextTag(AVAILABLE + 1);
+		static thread_local size_t tag = nextTag++;
+		return tag;
+	}
+
+	static void swapNodes(Node & first, Node & second)
+	{
+		std::swap(first.item, second.item);
+		std::swap(first.priority, second.priority);
+		std::swap(first.tag, second.tag);
+	}
+
+	void siftUp(size_t index, size_t tag)
+	{
+		while (index > 1)
+		{
+			size_t parentIndex = index / 2;
+			Node & parent = node(parentIndex);
+			Node & current = node(index);
+			std::unique_lock<SpinLock> parentLock(parent.lock);
+			std::unique_lock<SpinLock> currentLock(current.lock);
+
+			if (parent.tag == AVAILABLE && current.tag == tag)
+			{
+				if (current.priority < parent.priority)
+				{
+					swapNodes(current, parent);
+					index = parentIndex;
+				}
+				else
+				{
+					current.tag = AVAILABLE;
+					return;
+				}
+			}
+			else if (parent.tag == EMPTY)
+			{
+				// our item was moved to the root by getMin, which sifts it down
+				return;
+			}
+			else if (current.tag != tag)
+			{
+				// getMin moved our item up
+				index = parentIndex;
+			}
+			else
+			{
+				// the parent is still being inserted by another thread, let it finish
+				currentLock.unlock();
+				parentLock.unlock();
+				std::this_thread::yield();
+			}
+		}
+
+		Node & root = node(1);
+		std::lock_guard<SpinLock> rootLock(root.lock);
+		if (root.tag == tag)
+		{
+			root.tag = AVAILABLE;
+		}
+	}
+
+	void siftDown(size_t index, std::unique_lock<SpinLock> currentLock)
+	{
+		while (exists(2 * index + 1))
+		{
+			size_t leftIndex = 2 * index;
+			size_t rightIndex = 2 * index + 1;
+			Node & left = node(leftIndex);
+			Node & right = node(rightIndex);
+			std::unique_lock<SpinLock> leftLock(left.lock);
+			std::unique_lock<SpinLock> rightLock(right.lock);
+
+			if (left.tag == EMPTY)
+			{
+				return;
+			}
+
+			size_t childIndex = leftIndex;
+			if (right.tag != EMPTY && right.priority < left.priority)
+			{
+				childIndex = rightIndex;
+				leftLock.unlock();
+			}
+			else
+			{
+				rightLock.unlock();
+			}
+
+			Node & child = node(childIndex);
+			Node & current = node(index);
+			if (!(child.priority < current.priority))
+			{
+				return;
+			}
+
+			D("moving " << index << " down to " << childIndex);
+			swapNodes(child, current);
+			currentLock = std::move(childIndex == leftIndex ? leftLock : rightLock);
+			index = childIndex;
+		}
+	}
+
+public:
+	explicit PriorityQueue(size_t capacity = DEFAULT_CAPACITY) :
+		levelsCount(0),
+		count(0)
+	{
+		for (auto & level : levels)
+		{
+			level = nullptr;
+		}
+		reserve(std::max<size_t>(capacity, 1));
+	}
+
+	PriorityQueue(const PriorityQueue &) = delete;
+	PriorityQueue & operator=(const PriorityQueue &) = delete;
+
+	~PriorityQueue()
+	{
+		for (size_t level = 0; level < levelsCount; ++level)
+		{
+			delete[] levels[level].load();
+		}
+	}
+
+	bool getMin(T & result)
+	{
+		std::unique_lock<std::mutex> lock(heapLock);
+		size_t bottomIndex = count.load(std::memory_order_relaxed);
+		if (bottomIndex == 0)
+		{
+			return false;
+		}
+
+		count.store(bottomIndex - 1);
+		Node & bottom = node(bottomIndex);
+		std::unique_lock<SpinLock> bottomLock(bottom.lock);
+		lock.unlock();
+
+		T item = std::move(bottom.item);
+		Priority priority = bottom.priority;
+		bottom.tag = EMPTY;
+		bottomLock.unlock();
+
+		Node & root = node(1);
+		std::unique_lock<SpinLock> rootLock(root.lock);
+		if (root.tag == EMPTY)
+		{
+			// the bottom was the root
+			result = std::move(item);
+			return true;
+		}
+
+		result = std::move(root.item);
+		root.item = std::move(item);
+		root.priority = priority;
+		root.tag = AVAILABLE;
+		siftDown(1, std::move(rootLock));
+		return true;
+	}
+
+	void add(T task, Priority priority)
+	{
+		size_t tag = currentTag();
+
+		std::unique_lock<std::mutex> lock(heapLock);
+		size_t index = count.load(std::memory_order_relaxed) + 1;
+		reserve(index);
+		count.store(index);
+		Node & target = node(index);
+		std::unique_lock<SpinLock> targetLock(target.lock);
+		lock.unlock();
+
+		target.item = std::move(task);
+		target.priority = priority;
+		target.tag = tag;
+		targetLock.unlock();
+
+		siftUp(index, tag);
+	}
+
+	bool empty() const
+	{
+		return count.load() == 0;
+	}
+
+	size_t size() const
+	{
+		return count.load();
+	}
+};
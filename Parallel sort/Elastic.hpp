@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+#include "Future.hpp"
+
+// Worker count bounds for ThreadPool(ElasticPolicy(...)). A supervisor thread samples
+// the queue every sampleInterval: it starts a worker when the backlog exceeds
+// backlogPerThread tasks per running worker or when no worker made progress while
+// tasks were waiting, and retires a worker that stayed idle for idleTimeout.
+struct ElasticPolicy
+{
+	static const size_t DEFAULT_BACKLOG_PER_THREAD = 8;
+
+	static std::chrono::milliseconds defaultIdleTimeout()
+	{
+		return std::chrono::milliseconds(1000);
+	}
+
+	static std::chrono::milliseconds defaultSampleInterval()
+	{
+		return std::chrono::milliseconds(10);
+	}
+
+	size_t minThreads;
+	size_t maxThreads;
+	std::chrono::milliseconds idleTimeout;
+	std::chrono::milliseconds sampleInterval;
+	size_t backlogPerThread;
+
+	ElasticPolicy(size_t minThreads, size_t maxThreads,
+		std::chrono::milliseconds idleTimeout = defaultIdleTimeout(),
+		std::chrono::milliseconds sampleInterval = defaultSampleInterval(),
+		size_t backlogPerThread = DEFAULT_BACKLOG_PER_THREAD) :
+		minThreads(std::max<size_t>(minThreads, 1)),
+		maxThreads(std::max(maxThreads, std::max<size_t>(minThreads, 1))),
+		idleTimeout(idleTimeout),
+		sampleInterval(std::max(sampleInterval, std::chrono::milliseconds(1))),
+		backlogPerThread(std::max<size_t>(backlogPerThread, 1))
+	{
+	}
+};
+
+// One place for a worker thread. The worker writes isIdle and progress,
+// the supervisor only reads them and owns the rest.
+struct WorkerSlot
+{
+	std::thread thread;
+	std::atomic<bool> isFinished;
+	std::atomic<bool> isIdle;
+	std::atomic<uint64_t> progress;
+
+	size_t idleTicks;
+	uint64_t seenProgress;
+	char padding[64];
+
+	WorkerSlot() :
+		isFinished(false),
+		isIdle(false),
+		progress(0),
+		idleTicks(0),
+		seenProgress(0)
+	{
+	}
+};
+
+// Marks the current worker as blocked (waiting on I/O, a lock, ...) while it lives,
+// so an elastic pool can start a compensating worker. No-op outside of pools.
+class BlockingScope
+{
+private:
+	WaitHelper * helper;
+
+public:
+	BlockingScope() :
+		helper(WaitHelper::current())
+	{
+		if (helper)
+		{
+			helper->beginBlocking();
+		}
+	}
+
+	BlockingScope(const BlockingScope &) = delete;
+	BlockingScope & operator=(const BlockingScope &) = delete;
+
+	~BlockingScope()
+	{
+		if (helper)
+		{
+			helper->endBlocking();
+		}
+	}
+};
@@ -0,0 +1,136 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <cstddef>
+
+// Bounded lock-free multi-producer multi-consumer queue (D. Vyukov).
+// Every cell carries a sequence number telling whether it is ready for the
+// producer or for the consumer of the current lap, so a producer and a consumer
+// only ever contend on one CAS of their own position counter.
+template<class T>
+class RingBuffer
+{
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T item;
+	};
+
+	const size_t mask;
+	std::unique_ptr<Cell[]> cells;
+
+	char enqueuePadding[64];
+	std::atomic<size_t> enqueuePosition;
+	char dequeuePadding[64];
+	std::atomic<size_t> dequeuePosition;
+	char endPadding[64];
+
+	static size_t roundToPower2(size_t size)
+	{
+		size_t result = 2;
+		while (result < size)
+		{
+			result <<= 1;
+		}
+		return result;
+	}
+
+public:
+	// capacity is rounded up to a power of two
+	explicit RingBuffer(size_t capacity) :
+		mask(roundToPower2(capacity) - 1),
+		cells(new Cell[mask + 1]),
+		enqueuePosition(0),
+		dequeuePosition(0)
+	{
+		for (size_t index = 0; index <= mask; ++index)
+		{
+			cells[index].sequence.store(index, std::memory_order_relaxed);
+		}
+	}
+
+	// returns false when the buffer is full, item is moved from only on success
+	bool push(T & item)
+	{
+		Cell * cell;
+		size_t position = enqueuePosition.load(std::memory_order_relaxed);
+		while (true)
+		{
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff = (std::ptrdiff_t)sequence - (std::ptrdiff_t)position;
+
+			if (diff == 0)
+			{
+				if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				position = enqueuePosition.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->item = std::move(item);
+		cell->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T & result)
+	{
+		Cell * cell;
+		size_t position = dequeuePosition.load(std::memory_order_relaxed);
+		while (true)
+		{
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			std::ptrdiff_t diff = (std::ptrdiff_t)sequence - (std::ptrdiff_t)(position + 1);
+
+			if (diff == 0)
+			{
+				if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					break;
+				}
+			}
+			else if (diff < 0)
+			{
+				return false;
+			}
+			else
+			{
+				position = dequeuePosition.load(std::memory_order_relaxed);
+			}
+		}
+
+		result = std::move(cell->item);
+		cell->item = T();
+		cell->sequence.store(position + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	// approximate while other threads are working with the buffer
+	size_t size() const
+	{
+		size_t tail = enqueuePosition.load(std::memory_order_acquire);
+		size_t head = dequeuePosition.load(std::memory_order_acquire);
+		return tail > head ? tail - head : 0;
+	}
+
+	bool empty() const
+	{
+		return size() == 0;
+	}
+
+	size_t capacity() const
+	{
+		return mask + 1;
+	}
+};
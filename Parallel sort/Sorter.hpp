@@ -2,25 +2,27 @@
 #include <iterator>
 
 #include "ThreadPool.hpp"
+#include "TaskGroup.hpp"
 
 namespace my {
 
-	template<class ForwardIt, class Cmp = std::less<typename std::iterator_traits<ForwardIt>::value_type>>
-	void sort(ForwardIt begin, ForwardIt end, Cmp cmp = Cmp())
+	template<class Pool, class ForwardIt, class Cmp = std::less<typename std::iterator_traits<ForwardIt>::value_type>>
+	void sort(Pool & pool, ForwardIt begin, ForwardIt end, Cmp cmp = Cmp())
 	{
 		using T = typename std::iterator_traits<ForwardIt>::value_type;
 
-		SimpleThreadPool pool;
+		TaskGroup<Pool> group(pool);
 
 		std::function<void(ForwardIt, ForwardIt)> sorter;
 		sorter = [&](ForwardIt begin, ForwardIt end)
 		{
-			while (std::distance(begin, end) > 2)
-			{				
+			while (std::distance(begin, end) > 1)
+			{
 				size_t size = std::distance(begin, end);
 				auto pivotIter = begin;
 				std::advance(pivotIter, size / 2);
-				T const & pivot = *pivotIter;
+				// a copy: partition moves the elements around
+				T pivot = *pivotIter;
 
 				ForwardIt middle1 = std::partition(begin, end,
 					[&](const T & item)
@@ -34,12 +36,21 @@ namespace my {
 					return !cmp(pivot, item);
 				});
 
-
-				pool.runAsync<std::function<void()>>(std::bind(sorter, middle2, end));
+				if (std::distance(middle2, end) > 1)
+				{
+					group.run([&sorter, middle2, end]() { sorter(middle2, end); });
+				}
 				end = middle1;
 			}
 		};
 
 		sorter(begin, end);
+		group.wait();
+	}
+
+	template<class ForwardIt, class Cmp = std::less<typename std::iterator_traits<ForwardIt>::value_type>>
+	void sort(ForwardIt begin, ForwardIt end, Cmp cmp = Cmp())
+	{
+		sort(defaultThreadPool(), begin, end, cmp);
 	}
 }
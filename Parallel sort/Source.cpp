@@ -1,3 +1,6 @@
+#include <random>
+#include <numeric>
+
 #include "Sorter.hpp"
 
 #define BOOST_TEST_MODULE SorterTest
@@ -69,3 +72,29 @@ BOOST_AUTO_TEST_CASE(custom_comparer_test)
 		BOOST_CHECK_EQUAL(vector[index].first, index + 1);
 	}
 }
+
+BOOST_AUTO_TEST_CASE(random_test)
+{
+	std::mt19937 gen(42);
+	std::uniform_int_distribution<> dis(0, 100);
+	std::vector<int> vector(10000);
+	std::generate(vector.begin(), vector.end(), [&]() { return dis(gen); });
+
+	std::vector<int> expected = vector;
+	std::sort(expected.begin(), expected.end());
+	my::sort(vector.begin(), vector.end());
+
+	BOOST_CHECK(vector == expected);
+}
+
+BOOST_AUTO_TEST_CASE(shared_pool_test)
+{
+	WorkStealingThreadPool pool(4);
+	for (size_t iteration = 0; iteration < 10; ++iteration)
+	{
+		std::vector<int> vector(1000);
+		std::iota(vector.rbegin(), vector.rend(), 0);
+		my::sort(pool, vector.begin(), vector.end());
+		BOOST_CHECK(std::is_sorted(vector.begin(), vector.end()));
+	}
+}
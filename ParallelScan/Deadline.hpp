@@ -0,0 +1,116 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+
+#include "Stats.hpp"
+
+typedef std::chrono::steady_clock::time_point Deadline;
+
+// no deadline: the task never counts as missed
+inline Deadline no_deadline()
+{
+	return Deadline::max();
+}
+
+inline int64_t deadline_nanoseconds(Deadline deadline)
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch()).count();
+}
+
+struct DeadlineStats
+{
+	uint64_t finishedCount;
+	uint64_t missedCount;
+	// how late the missed tasks finished
+	LatencyHistogram lateness;
+};
+
+// Shared by all workers of a pool, updated once per task with a deadline.
+class DeadlineCounters
+{
+private:
+	char frontPadding[64];
+	std::atomic<uint64_t> finishedCount;
+	std::atomic<uint64_t> missedCount;
+	std::atomic<uint64_t> lateness[LatencyHistogram::BUCKETS_COUNT];
+	char backPadding[64];
+
+public:
+	DeadlineCounters() :
+		finishedCount(0),
+		missedCount(0)
+	{
+		for (auto & count : lateness)
+		{
+			count = 0;
+		}
+	}
+
+	void record(int64_t deadline)
+	{
+		int64_t finishedAt = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+		if (finishedAt > deadline)
+		{
+			lateness[LatencyHistogram::bucket(finishedAt - deadline)].fetch_add(1, std::memory_order_relaxed);
+			missedCount.fetch_add(1, std::memory_order_relaxed);
+		}
+		finishedCount.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	DeadlineStats snapshot() const
+	{
+		DeadlineStats stats;
+		stats.finishedCount = finishedCount.load(std::memory_order_relaxed);
+		stats.missedCount = missedCount.load(std::memory_order_relaxed);
+		for (size_t index = 0; index < LatencyHistogram::BUCKETS_COUNT; ++index)
+		{
+			stats.lateness.counts[index] = lateness[index].load(std::memory_order_relaxed);
+		}
+		return stats;
+	}
+};
+
+// Calls fn and records whether it finished before the deadline, also when it throws.
+template<class Fn>
+class DeadlineTracked
+{
+private:
+	struct Recorder
+	{
+		DeadlineCounters * counters;
+		int64_t deadline;
+
+		~Recorder()
+		{
+			counters->record(deadline);
+		}
+	};
+
+	Fn fn;
+	int64_t deadline;
+	DeadlineCounters * counters;
+
+public:
+	DeadlineTracked(Fn fn, int64_t deadline, DeadlineCounters * counters) :
+		fn(std::move(fn)),
+		deadline(deadline),
+		counters(counters)
+	{
+	}
+
+	template<class... Args>
+	auto operator()(Args &&... args) -> decltype(fn(std::forward<Args>(args)...))
+	{
+		Recorder recorder = { counters, deadline };
+		return fn(std::forward<Args>(args)...);
+	}
+};
+
+template<class Fn>
+DeadlineTracked<Fn> track_deadline(Fn fn, int64_t deadline, DeadlineCounters * counters)
+{
+	return DeadlineTracked<Fn>(std::move(fn), deadline, counters);
+}
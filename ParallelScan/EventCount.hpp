@@ -0,0 +1,151 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+#include <climits>
+#include <chrono>
+#include <ctime>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+// Lets a thread sleep until a condition may have changed without losing wake-ups:
+//
+//   auto key = eventCount.prepareWait();
+//   if (condition()) { eventCount.cancelWait(); ... }
+//   else { eventCount.wait(key); }
+//
+// notify() is a single fence and a load when nobody is waiting, so producers
+// do not pay for a syscall on every item.
+class EventCount
+{
+private:
+	std::atomic<uint32_t> epoch;
+	std::atomic<uint32_t> waitersCount;
+
+#ifndef __linux__
+	std::mutex mutex;
+	std::condition_variable condition;
+#endif
+
+	void wake(int count)
+	{
+		// pairs with prepareWait: either the waiter sees the new state or we see the waiter
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waitersCount.load(std::memory_order_relaxed) == 0)
+		{
+			return;
+		}
+
+#ifdef __linux__
+		epoch.fetch_add(1, std::memory_order_acq_rel);
+		syscall(SYS_futex, reinterpret_cast<uint32_t *>(&epoch), FUTEX_WAKE_PRIVATE,
+			count, nullptr, nullptr, 0);
+#else
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			epoch.fetch_add(1, std::memory_order_acq_rel);
+		}
+
+		if (count == INT_MAX)
+		{
+			condition.notify_all();
+		}
+		else
+		{
+			for (int index = 0; index < count; ++index)
+			{
+				condition.notify_one();
+			}
+		}
+#endif
+	}
+
+public:
+	typedef uint32_t Key;
+
+	EventCount() :
+		epoch(0),
+		waitersCount(0)
+	{
+	}
+
+	Key prepareWait()
+	{
+		waitersCount.fetch_add(1, std::memory_order_seq_cst);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		return epoch.load(std::memory_order_acquire);
+	}
+
+	void cancelWait()
+	{
+		waitersCount.fetch_sub(1, std::memory_order_seq_cst);
+	}
+
+	void wait(Key key)
+	{
+#ifdef __linux__
+		while (epoch.load(std::memory_order_acquire) == key)
+		{
+			syscall(SYS_futex, reinterpret_cast<uint32_t *>(&epoch), FUTEX_WAIT_PRIVATE,
+				key, nullptr, nullptr, 0);
+		}
+#else
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [&]() -> bool
+			{
+				return epoch.load(std::memory_order_acquire) != key;
+			});
+		}
+#endif
+		waitersCount.fetch_sub(1, std::memory_order_seq_cst);
+	}
+
+	// like wait, but returns after at most timeout nanoseconds, or spuriously
+	void waitFor(Key key, int64_t timeout)
+	{
+#ifdef __linux__
+		if (epoch.load(std::memory_order_acquire) == key)
+		{
+			timespec relative;
+			relative.tv_sec = static_cast<time_t>(timeout / 1000000000);
+			relative.tv_nsec = static_cast<long>(timeout % 1000000000);
+			syscall(SYS_futex, reinterpret_cast<uint32_t *>(&epoch), FUTEX_WAIT_PRIVATE,
+				key, &relative, nullptr, 0);
+		}
+#else
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait_for(lock, std::chrono::nanoseconds(timeout), [&]() -> bool
+			{
+				return epoch.load(std::memory_order_acquire) != key;
+			});
+		}
+#endif
+		waitersCount.fetch_sub(1, std::memory_order_seq_cst);
+	}
+
+	void notify()
+	{
+		wake(1);
+	}
+
+	// wakes at most count waiters
+	void notify(size_t count)
+	{
+		if (count > 0)
+		{
+			wake(count >= INT_MAX ? INT_MAX : static_cast<int>(count));
+		}
+	}
+
+	void notifyAll()
+	{
+		wake(INT_MAX);
+	}
+};
@@ -0,0 +1,79 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+
+// Partitions the workers of a PriorityThreadPool, e.g. PriorityThreadPool(8, PriorityLanes(2, -10)).
+// The first urgentWorkers workers only run urgent tasks, those with priority <= urgentThreshold
+// (smaller priorities come first). The others run every task, urgent ones first, so a backlog
+// of long batch tasks never occupies all workers. At least one worker always serves the shared lane.
+struct PriorityLanes
+{
+	size_t urgentWorkers;
+	int urgentThreshold;
+
+	PriorityLanes() :
+		urgentWorkers(0),
+		urgentThreshold(0)
+	{
+	}
+
+	PriorityLanes(size_t urgentWorkers, int urgentThreshold) :
+		urgentWorkers(urgentWorkers),
+		urgentThreshold(urgentThreshold)
+	{
+	}
+};
+
+struct LaneStats
+{
+	size_t workersCount;
+	size_t queueDepth;
+	// highest queueDepth seen since the pool started
+	size_t maxQueueDepth;
+};
+
+struct PriorityLaneStats
+{
+	LaneStats urgent;
+	LaneStats shared;
+};
+
+// queue length of one lane with its high-water mark, tasks are added before they are
+// published so a consumer never takes it below zero
+class LaneDepth
+{
+private:
+	std::atomic<size_t> depth;
+	std::atomic<size_t> maxDepth;
+
+public:
+	LaneDepth() :
+		depth(0),
+		maxDepth(0)
+	{
+	}
+
+	void added(size_t count)
+	{
+		size_t current = depth.fetch_add(count, std::memory_order_relaxed) + count;
+		size_t seen = maxDepth.load(std::memory_order_relaxed);
+		while (current > seen && !maxDepth.compare_exchange_weak(seen, current, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	void removed()
+	{
+		depth.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	size_t get() const
+	{
+		return depth.load(std::memory_order_relaxed);
+	}
+
+	size_t max() const
+	{
+		return maxDepth.load(std::memory_order_relaxed);
+	}
+};
@@ -6,9 +6,15 @@
 
 #include "ThreadPool.hpp"
 
-template<class ForwardIt, class Func>
-void parallel_scan(ForwardIt begin, ForwardIt end, Func func, size_t thread_count = std::thread::hardware_concurrency())
+// thread_count is the number of blocks per phase, 0 means one per worker plus the calling thread
+template<class Pool, class ForwardIt, class Func>
+void parallel_scan(Pool & pool, ForwardIt begin, ForwardIt end, Func func, size_t thread_count = 0)
 {
+	if (thread_count == 0)
+	{
+		thread_count = pool.size() + 1;
+	}
+
 	using T = typename std::iterator_traits<ForwardIt>::value_type;
 	auto get = [=](size_t index) -> T& { return *(begin + index); };
 	auto applier = [&](size_t begin, size_t end, size_t modulo, size_t step) 
@@ -19,7 +25,6 @@ void parallel_scan(ForwardIt begin, ForwardIt end, Func func, size_t thread_coun
 		}
 	};
 
-	SimpleThreadPool pool(thread_count-1);	
 	std::vector<Future<void>> futures;
 
 	size_t size = std::distance(begin, end);
@@ -37,13 +42,13 @@ void parallel_scan(ForwardIt begin, ForwardIt end, Func func, size_t thread_coun
 		{
 			// parallel implementation
 			size_t block_size = (items_to_work + 0.5 * thread_count) / thread_count;
-			for (size_t index = 0; index < thread_count - 1; ++index)
+			// each phase ends with a barrier, see ThreadPool::enableTracing to find the stalls
+			futures = pool.runAsyncRange(thread_count - 1, traced("scan up-sweep", [&](size_t index)
 			{
 				size_t begin = index * block_size * modulo + modulo - 1;
 				size_t end = begin + block_size * modulo;
-				auto binded_applier = std::bind(applier, begin, end, modulo, step);
-				futures.push_back(pool.runAsync(binded_applier));
-			}
+				applier(begin, end, modulo, step);
+			}));
 
 			size_t begin = (thread_count - 1) * block_size * modulo + modulo - 1;
 			size_t end = size;
@@ -74,13 +79,12 @@ void parallel_scan(ForwardIt begin, ForwardIt end, Func func, size_t thread_coun
 		{
 			// parallel implementation
 			size_t block_size = (items_to_work + 0.5 * thread_count) / thread_count;
-			for (size_t index = 0; index < thread_count - 1; ++index)
+			futures = pool.runAsyncRange(thread_count - 1, traced("scan down-sweep", [&](size_t index)
 			{
 				size_t begin = index * block_size * modulo + modulo - 1 + step;
 				size_t end = std::min(begin + block_size * modulo, size);
-				auto binded_applier = std::bind(applier, begin, end, modulo, step);
-				futures.push_back(pool.runAsync(binded_applier));
-			}
+				applier(begin, end, modulo, step);
+			}));
 
 			size_t begin = (thread_count - 1) * block_size * modulo + modulo - 1 + step;
 			size_t end = size;
@@ -96,4 +100,10 @@ void parallel_scan(ForwardIt begin, ForwardIt end, Func func, size_t thread_coun
 			futures.clear();
 		}
 	}
+}
+
+template<class ForwardIt, class Func>
+void parallel_scan(ForwardIt begin, ForwardIt end, Func func, size_t thread_count = std::thread::hardware_concurrency())
+{
+	parallel_scan(defaultThreadPool(), begin, end, func, thread_count);
 }
\ No newline at end of file
@@ -0,0 +1,116 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
+
+#include "TaskGroup.hpp"
+
+// Dependency graph of tasks on top of a thread pool. Every node counts its
+// unfinished predecessors and is posted to the pool the moment the count drops
+// to zero, so there is no barrier between "levels" of the graph.
+// The graph must be acyclic. Dependents of a node that threw are not run.
+//
+//   TaskGraph<SimpleThreadPool> graph(pool);
+//   auto load = graph.add(read);
+//   auto left = graph.add(processLeft), right = graph.add(processRight);
+//   graph.precede(load, left);
+//   graph.precede(load, right);
+//   graph.run();
+//   graph.wait();
+template<class Pool>
+class TaskGraph
+{
+public:
+	typedef size_t NodeId;
+
+private:
+	struct Node
+	{
+		std::function<void()> fn;
+		std::vector<NodeId> successors;
+		size_t predecessorsCount;
+		std::atomic<size_t> pendingCount;
+
+		explicit Node(std::function<void()> fn) :
+			fn(std::move(fn)),
+			predecessorsCount(0),
+			pendingCount(0)
+		{
+		}
+	};
+
+	std::vector<std::unique_ptr<Node>> nodes;
+	TaskGroup<Pool> group;
+
+	void schedule(NodeId id)
+	{
+		group.run([this, id]() { execute(id); });
+	}
+
+	void execute(NodeId id)
+	{
+		Node & node = *nodes[id];
+		node.fn();
+
+		for (NodeId successor : node.successors)
+		{
+			if (nodes[successor]->pendingCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+			{
+				schedule(successor);
+			}
+		}
+	}
+
+public:
+	explicit TaskGraph(Pool & pool) :
+		group(pool)
+	{
+	}
+
+	TaskGraph(const TaskGraph &) = delete;
+	TaskGraph & operator=(const TaskGraph &) = delete;
+
+	template<class Fn>
+	NodeId add(Fn fn)
+	{
+		nodes.emplace_back(new Node(std::function<void()>(std::move(fn))));
+		return nodes.size() - 1;
+	}
+
+	// after starts only when before has finished
+	void precede(NodeId before, NodeId after)
+	{
+		nodes[before]->successors.push_back(after);
+		++nodes[after]->predecessorsCount;
+	}
+
+	size_t size() const
+	{
+		return nodes.size();
+	}
+
+	// Posts the nodes without predecessors. The graph must not be changed
+	// until wait() returns, after that it can be run again.
+	void run()
+	{
+		for (auto & node : nodes)
+		{
+			node->pendingCount.store(node->predecessorsCount, std::memory_order_relaxed);
+		}
+
+		for (NodeId id = 0; id < nodes.size(); ++id)
+		{
+			if (nodes[id]->predecessorsCount == 0)
+			{
+				schedule(id);
+			}
+		}
+	}
+
+	// waits for every node that can run, rethrows the first exception thrown by one of them
+	void wait()
+	{
+		group.wait();
+	}
+};
@@ -0,0 +1,121 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <exception>
+#include <condition_variable>
+
+#include "Future.hpp"
+
+// Fork/join scope on top of a thread pool.
+// Children are counted with a single atomic instead of one Future per child,
+// and wait() executes pending tasks of the pool while children are outstanding.
+//
+//   TaskGroup<SimpleThreadPool> group(pool);
+//   group.run(first);
+//   group.run(second);
+//   group.wait();
+template<class Pool>
+class TaskGroup
+{
+private:
+	Pool & pool;
+	std::atomic<size_t> pendingCount;
+	std::exception_ptr exception;
+
+	std::mutex mutex;
+	std::condition_variable condition;
+
+	void finish()
+	{
+		size_t count = pendingCount.load(std::memory_order_relaxed);
+		while (count > 1)
+		{
+			if (pendingCount.compare_exchange_weak(count, count - 1, std::memory_order_acq_rel))
+			{
+				return;
+			}
+		}
+
+		// probably the last child: decrement under the lock, so that wait() cannot
+		// return and destroy the group while we are still touching it
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--pendingCount == 0)
+		{
+			condition.notify_all();
+		}
+	}
+
+	void join()
+	{
+		while (pendingCount.load(std::memory_order_acquire) != 0)
+		{
+			if (!pool.helpOnce())
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait_for(lock, std::chrono::microseconds(100), [this]() -> bool
+				{
+					return pendingCount.load() == 0;
+				});
+			}
+		}
+
+		// the last child may still hold the mutex in finish()
+		std::lock_guard<std::mutex> lock(mutex);
+	}
+
+public:
+	explicit TaskGroup(Pool & pool) :
+		pool(pool),
+		pendingCount(0)
+	{
+	}
+
+	TaskGroup(const TaskGroup &) = delete;
+	TaskGroup & operator=(const TaskGroup &) = delete;
+
+	~TaskGroup()
+	{
+		join();
+	}
+
+	template<class Fn>
+	void run(Fn task)
+	{
+		pendingCount.fetch_add(1, std::memory_order_relaxed);
+		post_unbounded(pool, [this, task]() mutable
+		{
+			try
+			{
+				task();
+			}
+			catch (const std::exception &)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!exception)
+				{
+					exception = std::current_exception();
+				}
+			}
+			finish();
+		});
+	}
+
+	// waits for all children, rethrows the first exception thrown by one of them
+	void wait()
+	{
+		join();
+
+		std::exception_ptr error;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			error.swap(exception);
+		}
+
+		if (error)
+		{
+			std::rethrow_exception(error);
+		}
+	}
+};
@@ -0,0 +1,206 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <utility>
+
+// label of the task running on this thread, set by traced()
+inline const char *& current_trace_label()
+{
+	static thread_local const char * label = nullptr;
+	return label;
+}
+
+// Calls fn with a label for the task timeline, see ThreadPool::enableTracing.
+// The label must outlive the pool, e.g. a string literal.
+template<class Fn>
+class TraceLabeled
+{
+private:
+	const char * label;
+	Fn fn;
+
+public:
+	TraceLabeled(const char * label, Fn fn) :
+		label(label),
+		fn(std::move(fn))
+	{
+	}
+
+	template<class... Args>
+	auto operator()(Args &&... args) -> decltype(fn(std::forward<Args>(args)...))
+	{
+		current_trace_label() = label;
+		return fn(std::forward<Args>(args)...);
+	}
+};
+
+template<class Fn>
+TraceLabeled<Fn> traced(const char * label, Fn fn)
+{
+	return TraceLabeled<Fn>(label, std::move(fn));
+}
+
+struct TraceEvent
+{
+	const char * label;
+	// steady clock in nanoseconds, enqueuedAt is 0 if the task was created before tracing started
+	int64_t enqueuedAt;
+	int64_t startedAt;
+	int64_t finishedAt;
+};
+
+// Events of one worker. Only the worker appends, so there is no lock: readers see
+// the prefix published by count. Events that do not fit are counted and dropped.
+class TraceBuffer
+{
+private:
+	std::unique_ptr<TraceEvent[]> events;
+	size_t capacity;
+	std::atomic<size_t> count;
+	std::atomic<uint64_t> droppedCount;
+
+public:
+	explicit TraceBuffer(size_t capacity) :
+		events(new TraceEvent[capacity]),
+		capacity(capacity),
+		count(0),
+		droppedCount(0)
+	{
+	}
+
+	static TraceBuffer *& current()
+	{
+		static thread_local TraceBuffer * buffer = nullptr;
+		return buffer;
+	}
+
+	void record(const char * label, int64_t enqueuedAt, int64_t startedAt, int64_t finishedAt)
+	{
+		size_t index = count.load(std::memory_order_relaxed);
+		if (index == capacity)
+		{
+			droppedCount.store(droppedCount.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			return;
+		}
+
+		TraceEvent & event = events[index];
+		event.label = label;
+		event.enqueuedAt = enqueuedAt;
+		event.startedAt = startedAt;
+		event.finishedAt = finishedAt;
+		count.store(index + 1, std::memory_order_release);
+	}
+
+	size_t size() const
+	{
+		return count.load(std::memory_order_acquire);
+	}
+
+	const TraceEvent & operator[](size_t index) const
+	{
+		return events[index];
+	}
+
+	uint64_t dropped() const
+	{
+		return droppedCount.load(std::memory_order_relaxed);
+	}
+};
+
+inline void write_json_string(std::ostream & out, const char * text)
+{
+	out << '"';
+	for (; *text; ++text)
+	{
+		unsigned char symbol = static_cast<unsigned char>(*text);
+		if (symbol == '"' || symbol == '\\')
+		{
+			out << '\\' << *text;
+		}
+		else if (symbol < 0x20)
+		{
+			char escaped[8];
+			std::snprintf(escaped, sizeof(escaped), "\\u%04x", symbol);
+			out << escaped;
+		}
+		else
+		{
+			out << *text;
+		}
+	}
+	out << '"';
+}
+
+// microseconds since origin with nanosecond precision, as the trace format expects
+inline void write_trace_time(std::ostream & out, int64_t time, int64_t origin)
+{
+	char formatted[32];
+	std::snprintf(formatted, sizeof(formatted), "%.3f", (time - origin) / 1000.0);
+	out << formatted;
+}
+
+// Chrome trace JSON (chrome://tracing, ui.perfetto.dev): a track per worker with a slice
+// per task, and the time each task spent in the queue as an async slice.
+template<class Buffers>
+void write_chrome_trace(std::ostream & out, const Buffers & buffers, int64_t origin)
+{
+	out << "{\"traceEvents\":[";
+	bool isFirst = true;
+	auto separate = [&]()
+	{
+		out << (isFirst ? "\n" : ",\n");
+		isFirst = false;
+	};
+
+	uint64_t droppedCount = 0;
+	uint64_t queueId = 0;
+	for (size_t worker = 0; worker < buffers.size(); ++worker)
+	{
+		const TraceBuffer & buffer = *buffers[worker];
+		droppedCount += buffer.dropped();
+
+		separate();
+		out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << worker
+			<< ",\"args\":{\"name\":\"worker " << worker << "\"}}";
+
+		size_t count = buffer.size();
+		for (size_t index = 0; index < count; ++index)
+		{
+			const TraceEvent & event = buffer[index];
+			const char * label = event.label ? event.label : "task";
+
+			separate();
+			out << "{\"name\":";
+			write_json_string(out, label);
+			out << ",\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,\"tid\":" << worker << ",\"ts\":";
+			write_trace_time(out, event.startedAt, origin);
+			out << ",\"dur\":";
+			write_trace_time(out, event.finishedAt, event.startedAt);
+			out << "}";
+
+			if (event.enqueuedAt == 0)
+			{
+				continue;
+			}
+
+			++queueId;
+			const char * phases[] = { "b", "e" };
+			int64_t times[] = { event.enqueuedAt, event.startedAt };
+			for (size_t phase = 0; phase < 2; ++phase)
+			{
+				separate();
+				out << "{\"name\":";
+				write_json_string(out, label);
+				out << ",\"cat\":\"queue\",\"ph\":\"" << phases[phase] << "\",\"id\":" << queueId
+					<< ",\"pid\":1,\"tid\":" << worker << ",\"ts\":";
+				write_trace_time(out, times[phase], origin);
+				out << "}";
+			}
+		}
+	}
+
+	out << "\n],\"displayTimeUnit\":\"ns\",\"otherData\":{\"droppedEvents\":" << droppedCount << "}}\n";
+}
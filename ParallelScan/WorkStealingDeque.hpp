@@ -0,0 +1,149 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <cstddef>
+
+// Chase-Lev deque with a fixed capacity.
+// The owner thread pushes and pops at the bottom (LIFO), other threads steal from the top (FIFO).
+// Unlike the classic version, an element is moved out only after its index has been claimed,
+// so T does not have to be trivially copyable. A slot keeps its "full" flag until the element
+// has been moved out, which stops the owner from reusing a slot a slow thief is still reading.
+template<class T>
+class WorkStealingDeque
+{
+private:
+	struct Slot
+	{
+		std::atomic<bool> full;
+		T item;
+
+		Slot() :
+			full(false)
+		{
+		}
+	};
+
+	const std::ptrdiff_t capacity;
+	std::unique_ptr<Slot[]> slots;
+
+	// top is written by thieves and bottom by the owner, keep them on different cache lines
+	char topPadding[64];
+	std::atomic<std::ptrdiff_t> top;
+	char bottomPadding[64];
+	std::atomic<std::ptrdiff_t> bottom;
+
+	Slot & at(std::ptrdiff_t index)
+	{
+		return slots[index % capacity];
+	}
+
+	void moveOut(std::ptrdiff_t index, T & result)
+	{
+		Slot & slot = at(index);
+		result = std::move(slot.item);
+		slot.item = T();
+		slot.full.store(false, std::memory_order_release);
+	}
+
+public:
+	explicit WorkStealingDeque(size_t capacity) :
+		capacity(capacity),
+		slots(new Slot[capacity]),
+		top(0),
+		bottom(0)
+	{
+	}
+
+	// owner only, returns false when the deque is full
+	bool push(T & item)
+	{
+		std::ptrdiff_t b = bottom.load(std::memory_order_relaxed);
+		std::ptrdiff_t t = top.load(std::memory_order_acquire);
+		if (b - t >= capacity)
+		{
+			return false;
+		}
+
+		Slot & slot = at(b);
+		while (slot.full.load(std::memory_order_acquire))
+		{
+			// a thief has claimed this slot one lap ago and is still moving the item out
+			std::this_thread::yield();
+		}
+
+		slot.item = std::move(item);
+		slot.full.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// owner only
+	bool pop(T & result)
+	{
+		std::ptrdiff_t b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::ptrdiff_t t = top.load(std::memory_order_relaxed);
+
+		if (t > b)
+		{
+			// empty
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return false;
+		}
+
+		if (t == b)
+		{
+			// last item, race with thieves for it
+			bool isWon = top.compare_exchange_strong(t, t + 1,
+				std::memory_order_seq_cst, std::memory_order_relaxed);
+			bottom.store(b + 1, std::memory_order_relaxed);
+			if (!isWon)
+			{
+				return false;
+			}
+		}
+
+		moveOut(b, result);
+		return true;
+	}
+
+	// any thread
+	bool steal(T & result)
+	{
+		std::ptrdiff_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		std::ptrdiff_t b = bottom.load(std::memory_order_acquire);
+
+		if (t >= b)
+		{
+			return false;
+		}
+
+		if (!top.compare_exchange_strong(t, t + 1,
+			std::memory_order_seq_cst, std::memory_order_relaxed))
+		{
+			return false;
+		}
+
+		moveOut(t, result);
+		return true;
+	}
+
+	bool empty() const
+	{
+		std::ptrdiff_t b = bottom.load(std::memory_order_acquire);
+		std::ptrdiff_t t = top.load(std::memory_order_acquire);
+		return t >= b;
+	}
+
+	// approximate while other threads push or steal
+	size_t size() const
+	{
+		std::ptrdiff_t b = bottom.load(std::memory_order_acquire);
+		std::ptrdiff_t t = top.load(std::memory_order_acquire);
+		return t >= b ? 0 : static_cast<size_t>(b - t);
+	}
+};
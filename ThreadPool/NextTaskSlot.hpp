@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+
+#include "Task.hpp"
+#include "IdlePolicy.hpp"
+
+// Single-entry LIFO slot of a worker. A task spawned by the running task waits here and runs
+// right after it on the same core, while the data they share is still in L1. A newer task pushes
+// the previous one out to the queue. Other workers take the task only once it has waited
+// longer than staleAfter, e.g. while its worker is busy with a long parent. Strategies that order
+// their tasks do not use it, see allowsNextTaskSlot.
+class NextTaskSlot
+{
+private:
+	enum State
+	{
+		EMPTY,
+		FULL,
+		// the owner or a thief is moving the task
+		BUSY
+	};
+
+	std::atomic<int> state;
+	std::atomic<int64_t> since;
+	Task task;
+	char padding[64];
+
+	bool acquire(int from)
+	{
+		int expected = from;
+		return state.compare_exchange_strong(expected, BUSY, std::memory_order_acquire);
+	}
+
+public:
+	NextTaskSlot() :
+		state(EMPTY),
+		since(0)
+	{
+	}
+
+	// owner only, returns true and moves the previous task to displaced if there was one
+	bool put(Task & next, Task & displaced)
+	{
+		int expected;
+		while (true)
+		{
+			expected = state.load(std::memory_order_relaxed);
+			if (expected != BUSY && state.compare_exchange_weak(expected, BUSY, std::memory_order_acquire))
+			{
+				break;
+			}
+			cpu_relax();
+		}
+
+		bool isDisplaced = expected == FULL;
+		if (isDisplaced)
+		{
+			displaced = std::move(task);
+		}
+		task = std::move(next);
+		since.store(Task::now(), std::memory_order_relaxed);
+		state.store(FULL, std::memory_order_release);
+		return isDisplaced;
+	}
+
+	// owner only
+	bool take(Task & result)
+	{
+		if (state.load(std::memory_order_relaxed) != FULL || !acquire(FULL))
+		{
+			return false;
+		}
+
+		result = std::move(task);
+		state.store(EMPTY, std::memory_order_release);
+		return true;
+	}
+
+	// nanoseconds until steal may take the task, -1 if the slot holds none
+	int64_t stealableIn(int64_t staleAfter) const
+	{
+		if (state.load(std::memory_order_relaxed) != FULL)
+		{
+			return -1;
+		}
+		return std::max<int64_t>(since.load(std::memory_order_relaxed) + staleAfter + 1 - Task::now(), 0);
+	}
+
+	bool steal(Task & result, int64_t staleAfter)
+	{
+		if (state.load(std::memory_order_relaxed) != FULL
+			|| Task::now() - since.load(std::memory_order_relaxed) <= staleAfter
+			|| !acquire(FULL))
+		{
+			return false;
+		}
+
+		result = std::move(task);
+		state.store(EMPTY, std::memory_order_release);
+		return true;
+	}
+};
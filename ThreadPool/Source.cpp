@@ -3,8 +3,16 @@
 #include <thread>
 #include <chrono>
 #include <future>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include <sstream>
+#include <string>
 
 #include "ThreadPool.hpp"
+#include "TaskGraph.hpp"
+#include "Coroutine.hpp"
 
 class Matrix
 {
@@ -66,9 +74,10 @@ void queue_test()
 
 	auto getter = [&]()
 	{
+		int value;
 		for (size_t index = 0; index < OPERATIONS_PER_THREAD; ++index)
 		{
-			queue.getMin();
+			queue.getMin(value);
 		}
 	};
 
@@ -97,18 +106,1128 @@ void queue_test()
 	assert(queue.empty());
 }
 
+void bucket_queue_test()
+{
+	std::cout << "starting bucket queue test" << std::endl;
+	BucketQueue<int> queue;
+	queue.add(1, 5);
+	queue.add(2, 3);
+	queue.add(3, 5);
+	queue.add(4, 63);
+
+	// smallest level first, FIFO inside a level
+	int expected[] = { 2, 1, 3, 4 };
+	for (int value : expected)
+	{
+		int result;
+		assert(queue.getMin(result) && result == value);
+	}
+	assert(queue.empty());
+
+	const int TASKS_COUNT = 10000;
+	std::atomic<int> counter(0);
+	{
+		BucketPriorityThreadPool pool(4);
+		std::thread producer([&]()
+		{
+			for (size_t index = 0; index < TASKS_COUNT; ++index)
+			{
+				pool.post([&]() { ++counter; }, index % 64 - 32);
+			}
+		});
+		pool.runAsyncRange(TASKS_COUNT, [&](size_t) { ++counter; }, -100);
+		producer.join();
+	}
+
+	std::cout << "tasks executed: " << counter << std::endl;
+	assert(counter == 2 * TASKS_COUNT);
+}
+
+struct RankError
+{
+	double mean;
+	size_t max;
+};
+
+// Fills the queue with priorities 0..count-1, pops everything from several threads
+// and replays the pops in order: the rank error of a pop is the number of smaller
+// priorities that were still in the queue.
+template<class Queue>
+RankError measure_rank_error(Queue & queue, int count, size_t threadsCount)
+{
+	std::vector<int> priorities(count);
+	std::iota(priorities.begin(), priorities.end(), 0);
+	std::shuffle(priorities.begin(), priorities.end(), std::mt19937(42));
+	for (int priority : priorities)
+	{
+		queue.add(priority, priority);
+	}
+
+	std::vector<int> popped(count);
+	std::atomic<size_t> ticket(0);
+	std::vector<std::thread> threads;
+	for (size_t index = 0; index < threadsCount; ++index)
+	{
+		threads.emplace_back([&]()
+		{
+			int value;
+			while (queue.getMin(value))
+			{
+				popped[ticket++] = value;
+			}
+		});
+	}
+	for (auto & thread : threads)
+	{
+		thread.join();
+	}
+
+	// Fenwick tree over the priorities still in the queue
+	std::vector<int> tree(count + 1, 0);
+	auto update = [&](int position, int delta)
+	{
+		for (++position; position <= count; position += position & -position)
+		{
+			tree[position] += delta;
+		}
+	};
+	auto smaller = [&](int position)
+	{
+		int result = 0;
+		for (; position > 0; position -= position & -position)
+		{
+			result += tree[position];
+		}
+		return result;
+	};
+
+	for (int priority = 0; priority < count; ++priority)
+	{
+		update(priority, 1);
+	}
+
+	RankError result = { 0, 0 };
+	for (int value : popped)
+	{
+		size_t rank = smaller(value);
+		result.mean += rank;
+		result.max = std::max(result.max, rank);
+		update(value, -1);
+	}
+	result.mean /= count;
+	return result;
+}
+
+void multi_queue_test()
+{
+	std::cout << "starting multi queue test" << std::endl;
+	const int COUNT = 20000;
+	const size_t THREADS_COUNT = 4;
+	const size_t QUEUES_COUNT = 16;
+
+	PriorityQueue<int> strict;
+	RankError strictError = measure_rank_error(strict, COUNT, 1);
+	assert(strictError.max == 0);
+
+	// one consumer shows the relaxation of the queue itself, with several of them
+	// a thread preempted between getMin and taking its ticket inflates the numbers
+	for (size_t choices = 1; choices <= 4; choices *= 2)
+	{
+		MultiQueue<int> relaxed(QUEUES_COUNT, choices);
+		RankError error = measure_rank_error(relaxed, COUNT, 1);
+		std::cout << QUEUES_COUNT << " queues, " << choices << " choices: mean rank error " 
+			<< error.mean << ", max " << error.max << std::endl;
+		assert(relaxed.empty());
+		assert(choices == 1 || error.mean < QUEUES_COUNT * 4);
+	}
+
+	MultiQueue<int> shared(QUEUES_COUNT);
+	RankError error = measure_rank_error(shared, COUNT, THREADS_COUNT);
+	std::cout << THREADS_COUNT << " consumers: mean rank error " << error.mean << ", max " << error.max << std::endl;
+	assert(shared.empty());
+
+	// the largest priority is a task like any other, the order of two items is relaxed
+	MultiQueue<int> extremes(QUEUES_COUNT);
+	extremes.add(1, INT_MAX);
+	extremes.add(2, INT_MIN);
+	int first = 0, second = 0;
+	assert(!extremes.empty() && extremes.getMin(first) && extremes.getMin(second));
+	assert(first + second == 3 && extremes.empty());
+
+	std::atomic<int> counter(0);
+	{
+		MultiQueueThreadPool pool(4, 4, 2);
+		pool.runAsyncRange(COUNT, [&](size_t) { ++counter; });
+	}
+	assert(counter == COUNT);
+	std::cout << "done" << std::endl;
+}
+
+void deadline_test()
+{
+	std::cout << "starting deadline test" << std::endl;
+	auto now = std::chrono::steady_clock::now();
+	std::vector<int> order;
+	std::atomic<bool> isReleased(false);
+	auto gate = [&]()
+	{
+		while (!isReleased)
+		{
+			std::this_thread::yield();
+		}
+	};
+
+	{
+		// one worker, blocked until everything is queued
+		DeadlineThreadPool pool(1);
+		pool.post(gate);
+		pool.post([&]() { order.push_back(0); });
+		for (int index = 3; index > 0; --index)
+		{
+			pool.post([&order, index]() { order.push_back(index); }, now + std::chrono::hours(index));
+		}
+		// already late
+		pool.runAsync([&]() { order.push_back(-1); }, now - std::chrono::seconds(1));
+		isReleased = true;
+		pool.runAsync([]() {}, now + std::chrono::hours(4)).get();
+
+		DeadlineStats stats = pool.deadlineStats();
+		assert(stats.finishedCount == 5 && stats.missedCount == 1);
+		assert(stats.lateness.count() == 1);
+	}
+	// earliest deadline first, no deadline last
+	assert((order == std::vector<int>{ -1, 1, 2, 3, 0 }));
+
+	order.clear();
+	isReleased = false;
+	{
+		// with aging the task without a deadline overtakes the later urgent one
+		DeadlineThreadPool pool(1, std::chrono::milliseconds(1));
+		pool.post(gate);
+		pool.post([&]() { order.push_back(0); });
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		pool.post([&]() { order.push_back(1); }, std::chrono::steady_clock::now() + std::chrono::seconds(1));
+		isReleased = true;
+	}
+	assert((order == std::vector<int>{ 0, 1 }));
+	std::cout << "done" << std::endl;
+}
+
+void work_stealing_test()
+{
+	std::cout << "starting work stealing test" << std::endl;
+	const int TASKS_COUNT = 100;
+	std::atomic<int> counter(0);
+
+	{
+		WorkStealingThreadPool pool(4);
+		std::vector<Future<void>> futures;
+		for (size_t index = 0; index < TASKS_COUNT; ++index)
+		{
+			// every task spawns children from inside the pool, they go to the local queue of the worker
+			futures.push_back(pool.runAsync([&]()
+			{
+				for (size_t child = 0; child < TASKS_COUNT; ++child)
+				{
+					pool.runAsync([&]() { ++counter; });
+				}
+			}));
+		}
+
+		std::for_each(futures.begin(), futures.end(), std::mem_fn(&Future<void>::get));
+	}
+
+	std::cout << "tasks executed: " << counter << std::endl;
+	assert(counter == TASKS_COUNT * TASKS_COUNT);
+
+	// queued right away, so the worker may take it before it ever waits
+	WorkStealingThreadPool pool(1);
+	const size_t CHILDREN_COUNT = 8;
+	auto spawned = pool.runAsync([&]()
+	{
+		for (size_t child = 0; child < CHILDREN_COUNT; ++child)
+		{
+			pool.post([]() {});
+		}
+		// one child waits in the next slot, the others in the deque of the worker
+		return pool.injectedDepth() == 0 && pool.queueDepth() == CHILDREN_COUNT - 1;
+	});
+	assert(spawned.get());
+}
+
+void ring_buffer_test()
+{
+	std::cout << "starting ring buffer test" << std::endl;
+	const int TASKS_COUNT = 100000;
+	const size_t CAPACITY = 64;
+	std::atomic<int> counter(0);
+
+	{
+		// small capacity, so producers have to wait for the workers
+		RingBufferThreadPool pool(4, CAPACITY);
+		auto producer = [&]()
+		{
+			for (size_t index = 0; index < TASKS_COUNT; ++index)
+			{
+				pool.runAsync([&]() { ++counter; });
+			}
+		};
+
+		std::thread first(producer), second(producer);
+		first.join();
+		second.join();
+	}
+
+	std::cout << "tasks executed: " << counter << std::endl;
+	assert(counter == 2 * TASKS_COUNT);
+
+	// the only worker fills the ring itself, it runs queued tasks instead of waiting for room
+	const size_t CHILDREN_COUNT = 10;
+	counter = 0;
+	{
+		RingBufferThreadPool pool(1, 2);
+		pool.runAsync([&]()
+		{
+			for (size_t index = 0; index < CHILDREN_COUNT; ++index)
+			{
+				pool.post([&]() { ++counter; });
+			}
+			pool.runAsyncRange(CHILDREN_COUNT, [&](size_t) { ++counter; });
+		}).get();
+	}
+	assert(counter == 2 * CHILDREN_COUNT);
+}
+
+void continuation_test()
+{
+	std::cout << "starting continuation test" << std::endl;
+	SimpleThreadPool pool(2);
+
+	auto first = pool.runAsync([]() { return 20; });
+	auto second = first.then(pool, [](Future<int> value) { return value.get() + 1; });
+	auto third = second.then(pool, [](Future<int> value) { return value.get() * 2; });
+	assert(third.get() == 42);
+
+	std::vector<Future<int>> futures = pool.runAsyncRange(10, [](size_t index) { return (int)index; });
+	std::atomic<int> sum(0);
+	auto all = when_all(futures).then(pool, [&](Future<void>)
+	{
+		for (auto & future : futures)
+		{
+			sum += future.get();
+		}
+	});
+	all.get();
+	assert(sum == 45);
+
+	auto any = when_any(futures);
+	assert(any.get() < futures.size());
+
+	bool isThrown = false;
+	try
+	{
+		when_any(std::vector<Future<int>>()).get();
+	}
+	catch (const std::exception &)
+	{
+		isThrown = true;
+	}
+	assert(isThrown);
+	std::cout << "done" << std::endl;
+}
+
+void move_result_test()
+{
+	std::cout << "starting move result test" << std::endl;
+	const size_t SIZE = 1 << 20;
+	SimpleThreadPool pool(2);
+
+	auto future = pool.runAsync([=]() { return std::vector<int>(SIZE, 1); });
+	// get returns a reference to the stored result, no copy per call
+	const std::vector<int> & first = future.get();
+	const std::vector<int> & second = future.get();
+	assert(&first == &second && first.size() == SIZE);
+
+	// take moves the buffer out
+	const int * buffer = first.data();
+	std::vector<int> result = future.take();
+	assert(result.data() == buffer && result.size() == SIZE);
+	assert(future.isReady());
+	std::cout << "done" << std::endl;
+}
+
+template<class Pool>
+int parallel_fibonacci(Pool & pool, int number)
+{
+	if (number < 2)
+	{
+		return number;
+	}
+
+	// waiting inside a worker runs the queued subtasks instead of blocking it
+	auto first = pool.runAsync([&pool, number]() { return parallel_fibonacci(pool, number - 1); });
+	auto second = pool.runAsync([&pool, number]() { return parallel_fibonacci(pool, number - 2); });
+	return first.get() + second.get();
+}
+
+void helping_test()
+{
+	std::cout << "starting helping test" << std::endl;
+	const int NUMBER = 15;
+	const int EXPECTED = 610;
+
+	SimpleThreadPool simplePool(2);
+	assert(parallel_fibonacci(simplePool, NUMBER) == EXPECTED);
+
+	WorkStealingThreadPool stealingPool(2);
+	assert(parallel_fibonacci(stealingPool, NUMBER) == EXPECTED);
+
+	RingBufferThreadPool ringPool(2);
+	assert(parallel_fibonacci(ringPool, NUMBER) == EXPECTED);
+
+	PriorityThreadPool priorityPool(2);
+	assert(parallel_fibonacci(priorityPool, NUMBER) == EXPECTED);
+
+	BucketPriorityThreadPool bucketPool(2);
+	assert(parallel_fibonacci(bucketPool, NUMBER) == EXPECTED);
+	std::cout << "done" << std::endl;
+}
+
+void idle_policy_test()
+{
+	std::cout << "starting idle policy test" << std::endl;
+	const int TASKS_COUNT = 1000;
+	std::atomic<int> counter(0);
+
+	{
+		// workers park right away, then spin for a long time before parking
+		SimpleThreadPool parkingPool(2, IdlePolicy::park());
+		WorkStealingThreadPool spinningPool(2, IdlePolicy(100000, 100));
+		RingBufferThreadPool ringPool(2, 64, IdlePolicy::park());
+		for (size_t index = 0; index < TASKS_COUNT; ++index)
+		{
+			parkingPool.post([&]() { ++counter; });
+			spinningPool.post([&]() { ++counter; });
+			ringPool.post([&]() { ++counter; });
+			// let the workers go idle between some of the tasks
+			if (index % 100 == 0)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+	}
+
+	std::cout << "tasks executed: " << counter << std::endl;
+	assert(counter == 3 * TASKS_COUNT);
+}
+
+void affinity_test()
+{
+	std::cout << "starting affinity test" << std::endl;
+	const CpuTopology & topology = CpuTopology::system();
+	std::cout << "usable cpus: " << topology.size() << std::endl;
+
+	auto cpus = topology.placement(AffinityPolicy::Scatter, 2 * topology.size());
+	assert(cpus.size() == 2 * topology.size());
+	assert(topology.distance(cpus[0], cpus[0]) == CpuTopology::SAME_CORE);
+	assert(topology.placement(AffinityPolicy::None, 4).empty());
+
+	WorkStealingThreadPool pool(2, AffinityPolicy::Compact);
+	auto futures = pool.runAsyncRange(2, [](size_t) { return current_thread_cpu(); });
+	for (auto & future : futures)
+	{
+		int cpu = future.get();
+		assert(cpu == -1 || topology.distance(cpu, cpu) == CpuTopology::SAME_CORE);
+	}
+	std::cout << "done" << std::endl;
+}
+
+void elastic_test()
+{
+	std::cout << "starting elastic test" << std::endl;
+	ElasticPolicy elastic(1, 4, std::chrono::milliseconds(50), std::chrono::milliseconds(5));
+	{
+		SimpleThreadPool pool(elastic);
+		assert(pool.size() == 1);
+
+		// the only worker blocks until the second task runs, which needs a compensating worker
+		std::atomic<bool> isSignaled(false);
+		auto waiter = pool.runAsync([&]()
+		{
+			BlockingScope blocking;
+			while (!isSignaled)
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		});
+		pool.runAsync([&]() { isSignaled = true; }).get();
+		waiter.get();
+		assert(pool.size() > 1);
+
+		// slow tasks without progress make the pool grow up to the maximum
+		std::atomic<int> running(0), maxRunning(0);
+		auto futures = pool.runAsyncRange(16, [&](size_t)
+		{
+			int current = ++running;
+			int seen = maxRunning;
+			while (current > seen && !maxRunning.compare_exchange_weak(seen, current))
+			{
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(20));
+			--running;
+		});
+		std::for_each(futures.begin(), futures.end(), std::mem_fn(&Future<void>::get));
+		std::cout << "most workers at once: " << maxRunning << std::endl;
+		assert(maxRunning > 1 && maxRunning <= 4);
+
+		// idle workers retire down to the minimum
+		for (size_t attempt = 0; attempt < 200 && pool.size() > 1; ++attempt)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		assert(pool.size() == 1);
+		assert(pool.runAsync([]() { return 1; }).get() == 1);
+	}
+
+	{
+		// work stealing workers reuse the queue of their slot
+		WorkStealingThreadPool pool(elastic);
+		assert(parallel_fibonacci(pool, 15) == 610);
+	}
+	std::cout << "done" << std::endl;
+}
+
+void task_graph_test()
+{
+	std::cout << "starting task graph test" << std::endl;
+	const size_t NODES_COUNT = 200;
+	const size_t EDGES_PER_NODE = 3;
+
+	WorkStealingThreadPool pool(4);
+	TaskGraph<WorkStealingThreadPool> graph(pool);
+
+	// random DAG: edges only go from smaller to bigger ids
+	std::atomic<size_t> clock(0);
+	std::vector<size_t> started(NODES_COUNT), finished(NODES_COUNT);
+	std::vector<std::pair<size_t, size_t>> edges;
+	std::mt19937 random(7);
+	for (size_t id = 0; id < NODES_COUNT; ++id)
+	{
+		graph.add([&, id]()
+		{
+			started[id] = clock++;
+			finished[id] = clock++;
+		});
+
+		for (size_t edge = 0; id > 0 && edge < EDGES_PER_NODE; ++edge)
+		{
+			size_t before = random() % id;
+			graph.precede(before, id);
+			edges.emplace_back(before, id);
+		}
+	}
+
+	// the same graph runs twice
+	for (size_t run = 0; run < 2; ++run)
+	{
+		graph.run();
+		graph.wait();
+		assert(clock == 2 * NODES_COUNT * (run + 1));
+		for (auto & edge : edges)
+		{
+			assert(finished[edge.first] < started[edge.second]);
+		}
+	}
+
+	// dependents of a failed node are skipped
+	TaskGraph<WorkStealingThreadPool> failing(pool);
+	std::atomic<bool> isSkippedRun(false);
+	auto first = failing.add([]() { throw std::runtime_error("failed"); });
+	auto second = failing.add([&]() { isSkippedRun = true; });
+	failing.precede(first, second);
+	failing.run();
+	bool isThrown = false;
+	try
+	{
+		failing.wait();
+	}
+	catch (const std::runtime_error & e)
+	{
+		isThrown = std::string(e.what()) == "failed";
+	}
+	assert(isThrown && !isSkippedRun);
+	std::cout << "done" << std::endl;
+}
+
+#ifdef THREAD_POOL_COROUTINES
+CoTask<int> square_later(WorkStealingThreadPool & pool, int value)
+{
+	int squared = co_await pool.runAsync([value]() { return value * value; });
+	co_return squared;
+}
+
+CoTask<int> pipeline(WorkStealingThreadPool & pool, int value)
+{
+	// a suspended pipeline holds a coroutine frame, not a worker
+	int squared = co_await square_later(pool, value);
+	Future<int> doubled = pool.runAsync([squared]() { return 2 * squared; });
+	co_return co_await doubled;
+}
+
+CoTask<void> failing_pipeline(WorkStealingThreadPool & pool)
+{
+	co_await pool.runAsync([]() { throw std::runtime_error("failed"); });
+}
+
+void coroutine_test()
+{
+	std::cout << "starting coroutine test" << std::endl;
+	const int PIPELINES_COUNT = 20000;
+
+	WorkStealingThreadPool pool(2);
+	std::vector<Future<int>> results;
+	for (int index = 0; index < PIPELINES_COUNT; ++index)
+	{
+		results.push_back(pipeline(pool, index % 100).start(pool));
+	}
+
+	long long sum = 0, expected = 0;
+	for (int index = 0; index < PIPELINES_COUNT; ++index)
+	{
+		sum += results[index].get();
+		expected += 2 * (index % 100) * (index % 100);
+	}
+	assert(sum == expected);
+
+	bool isThrown = false;
+	try
+	{
+		failing_pipeline(pool).start(pool).get();
+	}
+	catch (const std::exception &)
+	{
+		isThrown = true;
+	}
+	assert(isThrown);
+	std::cout << "done" << std::endl;
+}
+#endif
+
+void timer_test()
+{
+	std::cout << "starting timer test" << std::endl;
+	typedef std::chrono::steady_clock Clock;
+	const size_t TIMERS_COUNT = 1000;
+
+	// the two workers stay free while a thousand timers wait
+	WorkStealingThreadPool pool(2);
+	std::vector<Clock::time_point> deadlines(TIMERS_COUNT), firedAt(TIMERS_COUNT);
+	std::vector<Future<void>> fired(TIMERS_COUNT);
+	std::mt19937 random(11);
+	for (size_t index = 0; index < TIMERS_COUNT; ++index)
+	{
+		auto delay = std::chrono::milliseconds(random() % 200);
+		deadlines[index] = Clock::now() + delay;
+		Future<void> done = fired[index];
+		pool.runAfter(delay, [&firedAt, done, index]() mutable
+		{
+			firedAt[index] = Clock::now();
+			done.set();
+		});
+	}
+	assert(pool.runAsync([]() { return 42; }).get() == 42);
+	when_all(fired).get();
+	for (size_t index = 0; index < TIMERS_COUNT; ++index)
+	{
+		assert(firedAt[index] >= deadlines[index]);
+	}
+
+	// timers that expire at different ticks run in order on a single worker
+	const size_t ORDERED_COUNT = 20;
+	SimpleThreadPool single(1);
+	std::vector<size_t> firingOrder;
+	std::vector<Future<void>> orderedFired(ORDERED_COUNT);
+	for (size_t index = 0; index < ORDERED_COUNT; ++index)
+	{
+		Future<void> done = orderedFired[index];
+		single.runAfter(std::chrono::milliseconds(2 * (index + 1)), [&firingOrder, done, index]() mutable
+		{
+			firingOrder.push_back(index);
+			done.set();
+		});
+	}
+	when_all(orderedFired).get();
+	assert(firingOrder.size() == ORDERED_COUNT && std::is_sorted(firingOrder.begin(), firingOrder.end()));
+
+	// a cancelled timer does not run, neither does one that is still pending when the pool goes away
+	std::atomic<bool> isCancelledRun(false);
+	pool.runAfter(std::chrono::milliseconds(20), [&]() { isCancelledRun = true; }).cancel();
+	pool.runAfter(std::chrono::hours(1), [&]() { isCancelledRun = true; });
+
+	// the n-th run of a periodic timer is not before n periods have passed
+	const auto PERIOD = std::chrono::milliseconds(10);
+	std::atomic<int> ticks(0);
+	std::atomic<bool> isEarly(false);
+	auto periodStart = Clock::now();
+	auto periodic = pool.runEvery(PERIOD, [&]()
+	{
+		int tick = ++ticks;
+		if (Clock::now() < periodStart + tick * PERIOD)
+		{
+			isEarly = true;
+		}
+	});
+	while (ticks < 5)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	periodic.cancel();
+	int ticksAtCancel = ticks;
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	assert(!isEarly);
+	// a run that was already handed to a worker may still finish
+	assert(ticks <= ticksAtCancel + 1);
+	assert(!isCancelledRun);
+	std::cout << "done" << std::endl;
+}
+
+void backpressure_test()
+{
+	std::cout << "starting backpressure test" << std::endl;
+	const size_t CAPACITY = 4;
+
+	SimpleThreadPool pool(1);
+	pool.setCapacity(CAPACITY, OverflowPolicy::FailFast);
+
+	// the only worker is held, so the queue fills up
+	std::atomic<bool> isStarted(false), isReleased(false);
+	auto gate = pool.runAsync([&]()
+	{
+		isStarted = true;
+		while (!isReleased)
+		{
+			std::this_thread::yield();
+		}
+	});
+	while (!isStarted)
+	{
+		std::this_thread::yield();
+	}
+
+	std::vector<Future<int>> queued;
+	for (size_t index = 0; index < CAPACITY; ++index)
+	{
+		auto submission = pool.submit(OverflowPolicy::FailFast, [index]() { return static_cast<int>(index); });
+		assert(submission.first == SubmitStatus::Queued);
+		queued.push_back(submission.second);
+	}
+
+	auto rejected = pool.submit(OverflowPolicy::FailFast, []() { return -1; });
+	assert(rejected.first == SubmitStatus::Rejected);
+	// the caller can tell a rejection from a failure of the task
+	bool isThrown = false;
+	try
+	{
+		rejected.second.get();
+	}
+	catch (const std::runtime_error & e)
+	{
+		isThrown = std::string(e.what()) == "queue is full";
+	}
+	assert(isThrown);
+
+	// a continuation has no future to reject, it is queued past the limit
+	auto continued = rejected.second.then(pool, [](Future<int>) { return 1; });
+
+	auto caller = std::this_thread::get_id();
+	auto inCaller = pool.submit(OverflowPolicy::CallerRuns, [&]() { return std::this_thread::get_id() == caller; });
+	assert(inCaller.first == SubmitStatus::RanInCaller && inCaller.second.isReady() && inCaller.second.get());
+
+	// the first queued task of the FIFO queue makes room for the new one
+	auto replacing = pool.submit(OverflowPolicy::DropNext, []() { return 100; });
+	assert(replacing.first == SubmitStatus::Queued && queued[0].isReady());
+	isThrown = false;
+	try
+	{
+		queued[0].get();
+	}
+	catch (const std::runtime_error & e)
+	{
+		isThrown = std::string(e.what()) == "task was dropped before it ran";
+	}
+	assert(isThrown);
+
+	// a blocked producer goes on once the worker takes tasks again
+	pool.setCapacity(CAPACITY, OverflowPolicy::Block);
+	std::atomic<bool> isSubmitted(false);
+	std::thread producer([&]()
+	{
+		pool.runAsync([]() { return 0; });
+		isSubmitted = true;
+	});
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	assert(!isSubmitted);
+	isReleased = true;
+	producer.join();
+	gate.get();
+	assert(replacing.second.get() == 100);
+	assert(continued.get() == 1);
+	for (size_t index = 1; index < CAPACITY; ++index)
+	{
+		assert(queued[index].get() == static_cast<int>(index));
+	}
+
+	BackpressureStats stats = pool.backpressureStats();
+	assert(stats.rejectedCount == 1 && stats.ranInCallerCount == 1 && stats.droppedCount == 1 && stats.blockedCount == 1);
+	assert(stats.queuedCount == CAPACITY + 3);
+
+	// children and continuations queued past the limit are skipped, the bounded task behind them is dropped
+	SimpleThreadPool small(1);
+	auto source = small.runAsync([]() { return 1; });
+	source.get();
+	small.setCapacity(2, OverflowPolicy::DropNext);
+	isStarted = false;
+	isReleased = false;
+	small.post([&]()
+	{
+		isStarted = true;
+		while (!isReleased)
+		{
+			std::this_thread::yield();
+		}
+	});
+	while (!isStarted)
+	{
+		std::this_thread::yield();
+	}
+
+	std::atomic<int> childRuns(0);
+	TaskGroup<SimpleThreadPool> group(small);
+	group.run([&]() { ++childRuns; });
+	auto continuation = source.then(small, [](Future<int> result) { return result.get() + 1; });
+
+	// nothing is droppable yet, so the new task is rejected instead
+	auto refused = small.submit(OverflowPolicy::DropNext, []() { return 3; });
+	assert(refused.first == SubmitStatus::Rejected && refused.second.isReady());
+
+	small.setCapacity(3, OverflowPolicy::DropNext);
+	auto victim = small.runAsync([]() { return 4; });
+	auto newest = small.runAsync([]() { return 5; });
+	assert(victim.isReady());
+	isThrown = false;
+	try
+	{
+		victim.get();
+	}
+	catch (const std::exception &)
+	{
+		isThrown = true;
+	}
+	assert(isThrown);
+
+	isReleased = true;
+	group.wait();
+	assert(childRuns == 1);
+	assert(continuation.get() == 2);
+	assert(newest.get() == 5);
+	std::cout << "done" << std::endl;
+}
+
+void lanes_test()
+{
+	std::cout << "starting lanes test" << std::endl;
+	const int URGENT = -10;
+	const int BATCH = 10;
+	const size_t BATCH_COUNT = 4;
+
+	// one of the two workers only runs urgent tasks
+	PriorityThreadPool pool(2, PriorityLanes(1, 0));
+	std::atomic<size_t> batchFinished(0);
+	std::vector<Future<void>> batch;
+	for (size_t index = 0; index < BATCH_COUNT; ++index)
+	{
+		batch.push_back(pool.runAsync([&]()
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+			++batchFinished;
+		}, BATCH));
+	}
+
+	// the batch backlog holds the shared worker, the urgent one is free
+	pool.runAsync([]() {}, URGENT).get();
+	assert(batchFinished == 0);
+
+	// with the urgent worker busy, the shared worker takes urgent tasks between batch tasks
+	std::atomic<bool> isReleased(false);
+	auto holder = pool.runAsync([&]()
+	{
+		while (!isReleased)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		}
+	}, URGENT);
+	pool.runAsync([]() {}, URGENT).get();
+	isReleased = true;
+	holder.get();
+	assert(batchFinished < BATCH_COUNT);
+
+	std::for_each(batch.begin(), batch.end(), std::mem_fn(&Future<void>::get));
+	PriorityLaneStats stats = pool.laneStats();
+	assert(stats.urgent.workersCount == 1 && stats.shared.workersCount == 1);
+	assert(stats.shared.maxQueueDepth >= BATCH_COUNT - 1 && stats.shared.queueDepth == 0);
+	assert(stats.urgent.maxQueueDepth >= 1 && stats.urgent.queueDepth == 0);
+	std::cout << "done" << std::endl;
+}
+
+void keyed_test()
+{
+	std::cout << "starting keyed test" << std::endl;
+	const size_t WORKERS_COUNT = 4;
+	const size_t ROUNDS_COUNT = 100;
+	const size_t BACKLOG_SIZE = 64;
+
+	WorkStealingThreadPool pool(WORKERS_COUNT);
+
+	// balanced load: every key stays on one worker, a preempted worker may lose a task now and then
+	std::vector<std::vector<size_t>> ranOn(WORKERS_COUNT, std::vector<size_t>(WORKERS_COUNT, 0));
+	for (size_t round = 0; round < ROUNDS_COUNT; ++round)
+	{
+		std::vector<Future<size_t>> futures;
+		for (size_t key = 0; key < WORKERS_COUNT; ++key)
+		{
+			futures.push_back(pool.runAsyncOn(key, []() { return current_worker_index(); }));
+		}
+		for (size_t key = 0; key < WORKERS_COUNT; ++key)
+		{
+			++ranOn[key][futures[key].get()];
+		}
+	}
+	for (size_t key = 0; key < WORKERS_COUNT; ++key)
+	{
+		size_t home = std::max_element(ranOn[key].begin(), ranOn[key].end()) - ranOn[key].begin();
+		assert(home == key && ranOn[key][home] > ROUNDS_COUNT / 2);
+	}
+
+	// a backlog on one key is shared with the idle workers
+	std::vector<Future<size_t>> backlog;
+	for (size_t index = 0; index < BACKLOG_SIZE; ++index)
+	{
+		backlog.push_back(pool.runAsyncOn(0, []()
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			return current_worker_index();
+		}));
+	}
+	std::vector<bool> isUsed(WORKERS_COUNT, false);
+	for (auto & future : backlog)
+	{
+		isUsed[future.get()] = true;
+	}
+	assert(std::count(isUsed.begin(), isUsed.end(), true) > 1);
+
+	// a lone task behind a long one goes to an idle worker once the grace period is over,
+	// the long task only ends after it ran
+	std::atomic<bool> isStarted(false), isLoneFinished(false);
+	auto longTask = pool.runAsyncOn(0, [&]()
+	{
+		isStarted = true;
+		auto start = std::chrono::steady_clock::now();
+		while (!isLoneFinished && std::chrono::steady_clock::now() - start < std::chrono::seconds(30))
+		{
+			std::this_thread::yield();
+		}
+		return std::make_pair(current_worker_index(), isLoneFinished.load());
+	});
+	while (!isStarted)
+	{
+		std::this_thread::yield();
+	}
+	auto lone = pool.runAsyncOn(0, [&]()
+	{
+		isLoneFinished = true;
+		return current_worker_index();
+	});
+	size_t loneWorker = lone.get();
+	auto longResult = longTask.get();
+	assert(longResult.second && loneWorker != longResult.first);
+	std::cout << "done" << std::endl;
+}
+
+void next_slot_test()
+{
+	std::cout << "starting next slot test" << std::endl;
+	const size_t TRIALS_COUNT = 100;
+
+	// a FIFO queue on its own would hand the child to whichever worker is free
+	SimpleThreadPool pool(2);
+	pool.enableStats(true);
+	size_t sameWorkerCount = 0;
+	for (size_t trial = 0; trial < TRIALS_COUNT; ++trial)
+	{
+		auto child = pool.runAsync([&]()
+		{
+			size_t parentIndex = current_worker_index();
+			return std::make_pair(parentIndex, pool.runAsync([]() { return current_worker_index(); }));
+		}).take();
+		sameWorkerCount += child.second.get() == child.first ? 1 : 0;
+	}
+	assert(sameWorkerCount > TRIALS_COUNT / 2);
+
+	// the parked worker is woken without queueing anything besides the parents and children
+	while (pool.stats().tasksExecuted() < 2 * TRIALS_COUNT)
+	{
+		std::this_thread::yield();
+	}
+	assert(pool.stats().tasksExecuted() == 2 * TRIALS_COUNT);
+	pool.enableStats(false);
+
+	// the parent keeps its worker busy while the other one is parked, it takes the child
+	// once the grace period is over and the parent only ends after that
+	std::atomic<size_t> childIndex(SIZE_MAX);
+	auto parent = pool.runAsync([&]()
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		pool.post([&]()
+		{
+			childIndex = current_worker_index();
+		});
+
+		auto start = std::chrono::steady_clock::now();
+		while (childIndex == SIZE_MAX && std::chrono::steady_clock::now() - start < std::chrono::seconds(30))
+		{
+			std::this_thread::yield();
+		}
+		return std::make_pair(current_worker_index(), childIndex.load());
+	});
+	auto result = parent.get();
+	assert(result.second != SIZE_MAX && result.second != result.first);
+
+	// an ordered strategy queues the child, so an urgent-only worker never runs a batch task
+	PriorityThreadPool lanePool(2, PriorityLanes(1, -10));
+	for (size_t trial = 0; trial < TRIALS_COUNT; ++trial)
+	{
+		auto laneChild = lanePool.runAsync([&]()
+		{
+			return lanePool.runAsync([]() { return current_worker_index(); });
+		}, -20).take();
+		assert(laneChild.get() == 1);
+	}
+	std::cout << "done" << std::endl;
+}
+
+size_t count_occurrences(const std::string & text, const std::string & pattern)
+{
+	size_t count = 0;
+	for (size_t position = text.find(pattern); position != std::string::npos; position = text.find(pattern, position + 1))
+	{
+		++count;
+	}
+	return count;
+}
+
+void trace_test()
+{
+	std::cout << "starting trace test" << std::endl;
+	const size_t TASKS_COUNT = 100;
+
+	SimpleThreadPool pool(2);
+	std::ostringstream empty;
+	pool.writeTrace(empty);
+	assert(count_occurrences(empty.str(), "\"ph\":\"X\"") == 0);
+
+	pool.enableTracing(true);
+	auto futures = pool.runAsyncRange(TASKS_COUNT, traced("trace \"test\"", [](size_t index) { return index; }));
+	for (auto & fut : futures)
+	{
+		fut.get();
+	}
+	pool.runAsync([]() {}).get();
+	pool.enableTracing(false);
+	pool.runAsync([]() {}).get();
+
+	// a worker records the task after its future is set
+	std::string trace;
+	for (size_t attempt = 0; attempt < 1000; ++attempt)
+	{
+		std::ostringstream out;
+		pool.writeTrace(out);
+		trace = out.str();
+		if (count_occurrences(trace, "\"ph\":\"X\"") >= TASKS_COUNT + 1)
+		{
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	assert(trace.find("{\"traceEvents\":[") == 0);
+	assert(count_occurrences(trace, "\"ph\":\"X\"") == TASKS_COUNT + 1);
+	assert(count_occurrences(trace, "{\"name\":\"trace \\\"test\\\"\",\"cat\":\"task\"") == TASKS_COUNT);
+	assert(count_occurrences(trace, "{\"name\":\"task\",\"cat\":\"task\"") == 1);
+	// the queue wait of every task
+	assert(count_occurrences(trace, "\"ph\":\"b\"") == TASKS_COUNT + 1);
+	assert(count_occurrences(trace, "\"ph\":\"e\"") == TASKS_COUNT + 1);
+	assert(count_occurrences(trace, "\"droppedEvents\":0") == 1);
+}
+
+void stats_test()
+{
+	std::cout << "starting stats test" << std::endl;
+	const int TASKS_COUNT = 1000;
+
+	WorkStealingThreadPool pool(2);
+	pool.enableStats(true);
+	auto futures = pool.runAsyncRange(TASKS_COUNT, [](size_t index) { return index; });
+	std::for_each(futures.begin(), futures.end(), std::mem_fn(&Future<size_t>::get));
+
+	// the last task may still be counted after its future is ready
+	while (pool.stats().tasksExecuted() < TASKS_COUNT)
+	{
+		std::this_thread::yield();
+	}
+
+	PoolStats stats = pool.stats();
+	assert(stats.workers.size() == 2);
+	assert(stats.queueDepth == 0);
+	assert(stats.runLatency.count() == stats.tasksExecuted());
+	std::cout << "tasks executed: " << stats.tasksExecuted() 
+		<< ", steals: " << stats.workers[0].steals + stats.workers[1].steals
+		<< ", p99 wait: " << stats.waitLatency.percentile(0.99).count() << "ns" << std::endl;
+}
+
 int main()
 {
 	queue_test();
+	bucket_queue_test();
+	multi_queue_test();
+	deadline_test();
+	work_stealing_test();
+	ring_buffer_test();
+	continuation_test();
+	move_result_test();
+	helping_test();
+	idle_policy_test();
+	affinity_test();
+	task_graph_test();
+#ifdef THREAD_POOL_COROUTINES
+	coroutine_test();
+#endif
+	timer_test();
+	keyed_test();
+	next_slot_test();
+	lanes_test();
+	backpressure_test();
+	trace_test();
+	stats_test();
+	elastic_test();
 
-	PriorityThreadPool pool;
+	// rows stay in the cache of the core that computes them
+	PriorityThreadPool pool(std::thread::hardware_concurrency(), AffinityPolicy::Compact);
 	
 	std::cout << "start matrix test" << std::endl;
 
 	srand(time(NULL));
 	const int size = 1000;
 	Matrix m1(size), m2(size), m3(size);
-	std::vector<Future<void>> futures;
 
 	std::cout << "begin fill" << std::endl;
 
@@ -130,10 +1249,7 @@ int main()
 
 	auto begin = std::chrono::high_resolution_clock::now();
 
-	for (size_t index = 0; index < size; ++index)
-	{
-		futures.push_back(pool.runAsync(std::bind(f, index)));
-	}
+	auto futures = pool.runAsyncRange(size, f);
 
 	std::for_each(futures.begin(), futures.end(), std::mem_fn(&Future<void>::get));
 
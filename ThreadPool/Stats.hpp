@@ -0,0 +1,198 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <cmath>
+#include <algorithm>
+
+// Latency histogram with power of two buckets: bucket i > 0 counts values in [2^(i-1), 2^i) nanoseconds.
+struct LatencyHistogram
+{
+	static const size_t BUCKETS_COUNT = 40;
+
+	uint64_t counts[BUCKETS_COUNT];
+
+	LatencyHistogram()
+	{
+		for (auto & count : counts)
+		{
+			count = 0;
+		}
+	}
+
+	static size_t bucket(int64_t nanoseconds)
+	{
+		size_t index = 0;
+		while (nanoseconds > 0 && index + 1 < BUCKETS_COUNT)
+		{
+			nanoseconds >>= 1;
+			++index;
+		}
+		return index;
+	}
+
+	uint64_t count() const
+	{
+		uint64_t result = 0;
+		for (auto count : counts)
+		{
+			result += count;
+		}
+		return result;
+	}
+
+	// upper bound of the bucket holding the given fraction of values, e.g. percentile(0.99)
+	std::chrono::nanoseconds percentile(double fraction) const
+	{
+		uint64_t total = count();
+		uint64_t target = static_cast<uint64_t>(std::ceil(fraction * total));
+		uint64_t seen = 0;
+		for (size_t index = 0; index < BUCKETS_COUNT && total > 0; ++index)
+		{
+			seen += counts[index];
+			if (seen >= std::max<uint64_t>(target, 1))
+			{
+				return std::chrono::nanoseconds(int64_t(1) << index);
+			}
+		}
+		return std::chrono::nanoseconds(0);
+	}
+
+	LatencyHistogram & operator+=(const LatencyHistogram & other)
+	{
+		for (size_t index = 0; index < BUCKETS_COUNT; ++index)
+		{
+			counts[index] += other.counts[index];
+		}
+		return *this;
+	}
+};
+
+struct WorkerStats
+{
+	uint64_t tasksExecuted;
+	uint64_t steals;
+	uint64_t failedSteals;
+	std::chrono::nanoseconds busyTime;
+	std::chrono::nanoseconds idleTime;
+	LatencyHistogram waitLatency;
+	LatencyHistogram runLatency;
+};
+
+struct PoolStats
+{
+	size_t queueDepth;
+	std::vector<WorkerStats> workers;
+	// enqueue to start and run time over all workers
+	LatencyHistogram waitLatency;
+	LatencyHistogram runLatency;
+
+	uint64_t tasksExecuted() const
+	{
+		uint64_t result = 0;
+		for (auto & worker : workers)
+		{
+			result += worker.tasksExecuted;
+		}
+		return result;
+	}
+};
+
+// Counters of one worker. Only the worker writes them, so updates are plain
+// relaxed load + store without read-modify-write; readers sum them up in snapshot().
+class WorkerCounters
+{
+private:
+	std::atomic<uint64_t> tasksExecuted;
+	std::atomic<uint64_t> steals;
+	std::atomic<uint64_t> failedSteals;
+	std::atomic<int64_t> busyTime;
+	std::atomic<int64_t> idleTime;
+	std::atomic<uint64_t> waitLatency[LatencyHistogram::BUCKETS_COUNT];
+	std::atomic<uint64_t> runLatency[LatencyHistogram::BUCKETS_COUNT];
+	// keeps the next worker's counters off our cache line
+	char padding[64];
+
+	template<class V>
+	static void add(std::atomic<V> & counter, V value)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
+
+	static void load(const std::atomic<uint64_t> (&from)[LatencyHistogram::BUCKETS_COUNT], LatencyHistogram & to)
+	{
+		for (size_t index = 0; index < LatencyHistogram::BUCKETS_COUNT; ++index)
+		{
+			to.counts[index] = from[index].load(std::memory_order_relaxed);
+		}
+	}
+
+public:
+	WorkerCounters() :
+		tasksExecuted(0),
+		steals(0),
+		failedSteals(0),
+		busyTime(0),
+		idleTime(0)
+	{
+		for (size_t index = 0; index < LatencyHistogram::BUCKETS_COUNT; ++index)
+		{
+			waitLatency[index] = 0;
+			runLatency[index] = 0;
+		}
+	}
+
+	// counters of the current worker while its pool collects stats, nullptr otherwise
+	static WorkerCounters *& current()
+	{
+		static thread_local WorkerCounters * counters = nullptr;
+		return counters;
+	}
+
+	// createdAt is 0 when the task was created before stats were enabled
+	void taskExecuted(int64_t createdAt, int64_t startedAt, int64_t finishedAt)
+	{
+		if (createdAt != 0)
+		{
+			add<uint64_t>(waitLatency[LatencyHistogram::bucket(startedAt - createdAt)], 1);
+		}
+		add<uint64_t>(runLatency[LatencyHistogram::bucket(finishedAt - startedAt)], 1);
+		// published last: a snapshot that sees the task also sees its latencies
+		tasksExecuted.store(tasksExecuted.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	void addBusyTime(int64_t nanoseconds)
+	{
+		add<int64_t>(busyTime, nanoseconds);
+	}
+
+	void addIdleTime(int64_t nanoseconds)
+	{
+		add<int64_t>(idleTime, nanoseconds);
+	}
+
+	void stealSucceeded()
+	{
+		add<uint64_t>(steals, 1);
+	}
+
+	void stealFailed()
+	{
+		add<uint64_t>(failedSteals, 1);
+	}
+
+	WorkerStats snapshot() const
+	{
+		WorkerStats stats;
+		stats.tasksExecuted = tasksExecuted.load(std::memory_order_acquire);
+		stats.steals = steals.load(std::memory_order_relaxed);
+		stats.failedSteals = failedSteals.load(std::memory_order_relaxed);
+		stats.busyTime = std::chrono::nanoseconds(busyTime.load(std::memory_order_relaxed));
+		stats.idleTime = std::chrono::nanoseconds(idleTime.load(std::memory_order_relaxed));
+		load(waitLatency, stats.waitLatency);
+		load(runLatency, stats.runLatency);
+		return stats;
+	}
+};
@@ -1,235 +1,2387 @@
+#pragma once
 #include <vector>
+#include <deque>
 #include <thread>
 #include <utility>
 #include <condition_variable>
 #include <type_traits>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <memory>
 
 #include "ThreadsafePriorityQueue.hpp"
+#include "BucketQueue.hpp"
+#include "MultiQueue.hpp"
+#include "Task.hpp"
+#include "WorkStealingDeque.hpp"
+#include "RingBuffer.hpp"
+#include "EventCount.hpp"
+#include "IdlePolicy.hpp"
+#include "Topology.hpp"
+#include "Stats.hpp"
+#include "Deadline.hpp"
+#include "Elastic.hpp"
+#include "TimingWheel.hpp"
+#include "Backpressure.hpp"
+#include "Lanes.hpp"
+#include "NextTaskSlot.hpp"
+#include "Trace.hpp"
+
+// slot of the current thread among the workers of its pool
+inline size_t & current_worker_index()
+{
+	static thread_local size_t index = SIZE_MAX;
+	return index;
+}
+
+// Pool::runAsyncOn when the strategy has keyed submission, a plain runAsync otherwise
+template<class Pool, class Fn>
+auto run_async_on(Pool & pool, size_t key, Fn fn, int) -> decltype(pool.runAsyncOn(key, std::move(fn)))
+{
+	return pool.runAsyncOn(key, std::move(fn));
+}
+
+template<class Pool, class Fn>
+auto run_async_on(Pool & pool, size_t, Fn fn, long) -> decltype(pool.runAsync(std::move(fn)))
+{
+	return pool.runAsync(std::move(fn));
+}
+
+template<class Pool, class Fn>
+auto run_async_on(Pool & pool, size_t key, Fn fn) -> decltype(run_async_on(pool, key, std::move(fn), 0))
+{
+	return run_async_on(pool, key, std::move(fn), 0);
+}
+
+// Strategy::attachWorker on each worker before its first task, if the strategy keeps per worker state
+template<class Strategy>
+auto attach_worker(Strategy & strategy, int) -> decltype(strategy.attachWorker())
+{
+	return strategy.attachWorker();
+}
+
+template<class Strategy>
+void attach_worker(Strategy &, long)
+{
+}
 
 template<template<class K> class QUEUE_STRATEGY>
 // QUEUE_STRATEGY: 
-// Future<R> runAsync(T task, ...)
-// std::shared_ptr<T> getNext();
+// QUEUE_STRATEGY(size_t workersCount, ...) - workersCount is the most workers that will run at once
+// Future<R> runAsync(Fn task, ...)
+// std::vector<Future<R>> runAsyncBulk(InputIt first, InputIt last, ...)
+// std::vector<Future<R>> runAsyncRange(size_t count, Fn task, ...)
+// void post(T task, ...) - no future is created
+// void postBulk(std::vector<T> & tasks, ...) - moves the tasks in with a single wakeup
+// bool getNext(T & task);
+// bool tryGetNext(T & task); - does not wait
+// size_t queueDepth() const; - approximate number of queued tasks
+// static constexpr bool allowsNextTaskSlot(); - true if a spawned task may run before queued ones, see NextTaskSlot
+// bool getNext(T & task, TryGet tryOther, ParkLimit parkLimit); - with next slots, also calls tryOther and
+//     parks for at most parkLimit() nanoseconds, 0 is no limit
+// void wakeIdle(); - with next slots, wakes a parked worker without queueing a task
+// void attachWorker(); - optional, called on every worker thread before it takes a task
 // void closeQueue();
-class ThreadPool : public QUEUE_STRATEGY<std::function<void()>>
+class ThreadPool : public QUEUE_STRATEGY<Task>, public WaitHelper
 {
-	typedef QUEUE_STRATEGY<std::function<void()>> Parent;
+	typedef QUEUE_STRATEGY<Task> Parent;
 private:
-	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<WorkerSlot>> slots;
+	// per worker, see NextTaskSlot
+	std::vector<std::unique_ptr<NextTaskSlot>> nextSlots;
+	// upper bound, incremented before a slot fills
+	std::atomic<size_t> fullNextSlots;
+	// workers parked in the strategy with no time limit, see waitNext
+	std::atomic<size_t> sleepingCount;
+	std::atomic<size_t> liveCount;
+	// guards starting and joining of worker threads
+	std::mutex workersMutex;
+	bool isStopping;
+
+	std::vector<std::unique_ptr<WorkerCounters>> counters;
+	std::atomic<bool> statsEnabled;
+
+	// created by the first enableTracing, traceOrigin is 0 until then
+	std::vector<std::unique_ptr<TraceBuffer>> traceBuffers;
+	std::atomic<int64_t> traceOrigin;
+	std::atomic<bool> tracingEnabled;
+	std::once_flag tracingOnce;
+
+	ElasticPolicy elastic;
+	bool isElastic;
+	std::thread supervisor;
+	std::condition_variable supervisorCondition;
+	std::atomic<size_t> blockedCount;
+	std::atomic<size_t> pendingRetires;
+
+	// started by the first runAfter or runEvery
+	std::unique_ptr<TimingWheel> timers;
+	std::once_flag timersOnce;
+
+	// 0 while unbounded, see setCapacity
+	std::atomic<size_t> capacity;
+	std::atomic<OverflowPolicy> defaultPolicy;
+	BackpressureCounters backpressure;
+	std::atomic<bool> isClosing;
+	std::atomic<size_t> waitingProducers;
+	std::mutex spaceMutex;
+	std::condition_variable spaceCondition;
+
+	// set by a retire task, the worker exits after the current task
+	static bool & retireRequested()
+	{
+		static thread_local bool isRequested = false;
+		return isRequested;
+	}
+
+	// records run time and enqueue-to-start latency while stats are enabled,
+	// and the task with its label while tracing is
+	static void runTask(Task & task)
+	{
+		WorkerCounters * workerCounters = WorkerCounters::current();
+		TraceBuffer * trace = TraceBuffer::current();
+		if (!workerCounters && !trace)
+		{
+			task();
+			return;
+		}
+
+		// a task that helps while it waits runs others inside, each of them has its own label
+		const char *& label = current_trace_label();
+		const char * outerLabel = label;
+		label = nullptr;
+
+		int64_t startedAt = Task::now();
+		task();
+		int64_t finishedAt = Task::now();
+		if (workerCounters)
+		{
+			workerCounters->taskExecuted(task.creationTime(), startedAt, finishedAt);
+		}
+		if (trace)
+		{
+			trace->record(label, task.creationTime(), startedAt, finishedAt);
+		}
+		label = outerLabel;
+	}
+
+	void doWork(size_t index, int cpu)
+	{
+		if (cpu >= 0)
+		{
+			pin_current_thread(cpu);
+		}
+
+		WaitHelper::current() = this;
+		current_worker_index() = index;
+		// a worker that never runs out of work must still spawn into its own queue
+		attach_worker(static_cast<Parent &>(*this), 0);
+		WorkerSlot & slot = *slots[index];
+		while(true)
+		{
+			WorkerCounters::current() = statsEnabled.load(std::memory_order_relaxed) ? counters[index].get() : nullptr;
+			int64_t idleSince = WorkerCounters::current() ? Task::now() : 0;
+
+			if (isElastic)
+			{
+				slot.isIdle.store(true, std::memory_order_relaxed);
+			}
+
+			Task task;
+			if (!takeNext(index, task) && !Parent::tryGetNext(task) && !stealNext(index, task) && !waitNext(index, task))
+			{
+				break;
+			}
+			taskTaken();
+			// checked again after the wait, so the first task after enableStats or enableTracing is recorded
+			WorkerCounters * workerCounters = statsEnabled.load(std::memory_order_relaxed) ? counters[index].get() : nullptr;
+			WorkerCounters::current() = workerCounters;
+			TraceBuffer::current() = tracingEnabled.load(std::memory_order_acquire) ? traceBuffers[index].get() : nullptr;
+
+			if (isElastic)
+			{
+				slot.isIdle.store(false, std::memory_order_relaxed);
+				slot.progress.store(slot.progress.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			}
+
+			if (!workerCounters)
+			{
+				runTask(task);
+			}
+			else
+			{
+				int64_t busySince = Task::now();
+				if (idleSince != 0)
+				{
+					workerCounters->addIdleTime(busySince - idleSince);
+				}
+				runTask(task);
+				workerCounters->addBusyTime(Task::now() - busySince);
+			}
+
+			if (retireRequested())
+			{
+				retireRequested() = false;
+				Task next;
+				if (takeNext(index, next))
+				{
+					Parent::post(std::move(next));
+				}
+				break;
+			}
+		}
+
+		--liveCount;
+		slot.isFinished = true;
+	}
+
+	static size_t workersCount(size_t threadCount)
+	{
+		// hardware_concurrency returns 0 when it is not computable
+		return threadCount == 0 ? 2 : threadCount;
+	}
+
+	// must be called with workersMutex held
+	void startWorker(size_t index, int cpu)
+	{
+		WorkerSlot & slot = *slots[index];
+		slot.isFinished = false;
+		slot.isIdle = false;
+		slot.idleTicks = 0;
+		++liveCount;
+		slot.thread = std::thread(&ThreadPool::doWork, this, index, cpu);
+	}
+
+	// must be called with workersMutex held, returns false at the maximum or when stopping
+	bool addWorker()
+	{
+		if (isStopping)
+		{
+			return false;
+		}
+
+		for (size_t index = 0; index < slots.size(); ++index)
+		{
+			WorkerSlot & slot = *slots[index];
+			if (slot.thread.joinable() && slot.isFinished)
+			{
+				slot.thread.join();
+			}
+
+			if (!slot.thread.joinable())
+			{
+				startWorker(index, -1);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void start(size_t slotsCount, size_t threadCount, AffinityPolicy affinity)
+	{
+		for (size_t index = 0; index < slotsCount; ++index)
+		{
+			slots.emplace_back(new WorkerSlot());
+			nextSlots.emplace_back(new NextTaskSlot());
+			counters.emplace_back(new WorkerCounters());
+		}
+
+		auto cpus = CpuTopology::system().placement(affinity, threadCount);
+		std::lock_guard<std::mutex> lock(workersMutex);
+		for (size_t index = 0; index < threadCount; ++index)
+		{
+			startWorker(index, cpus.empty() ? -1 : cpus[index]);
+		}
+	}
+
+	// how long a task waits in the next slot of a busy worker before others may take it
+	static int64_t nextSlotGrace()
+	{
+		return 50000;
+	}
+
+	bool takeNext(size_t index, Task & task)
+	{
+		if (!nextSlots[index]->take(task))
+		{
+			return false;
+		}
+
+		--fullNextSlots;
+		return true;
+	}
+
+	bool stealNext(size_t index, Task & task)
+	{
+		if (fullNextSlots.load() == 0)
+		{
+			return false;
+		}
+
+		for (size_t victim = 0; victim < nextSlots.size(); ++victim)
+		{
+			if (victim != index && nextSlots[victim]->steal(task, nextSlotGrace()))
+			{
+				--fullNextSlots;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// nanoseconds until the task in the next slot of another worker goes stale, 0 if none is waiting
+	int64_t nextSlotWait(size_t index) const
+	{
+		if (fullNextSlots.load() == 0)
+		{
+			return 0;
+		}
+
+		// a slot that is being filled is not visible yet
+		int64_t result = nextSlotGrace();
+		for (size_t victim = 0; victim < nextSlots.size(); ++victim)
+		{
+			int64_t staleIn = victim == index ? -1 : nextSlots[victim]->stealableIn(nextSlotGrace());
+			if (staleIn >= 0)
+			{
+				result = std::min(result, std::max<int64_t>(staleIn, 1));
+			}
+		}
+		return result;
+	}
+
+	bool waitNext(size_t index, Task & task)
+	{
+		return waitNext(index, task, std::integral_constant<bool, Parent::allowsNextTaskSlot()>());
+	}
+
+	bool waitNext(size_t, Task & task, std::false_type)
+	{
+		return Parent::getNext(task);
+	}
+
+	// A worker parks until the queue wakes it, or until a task in a next slot goes stale.
+	// Sleeping workers, those with no slot task to wait for, are woken by putNext.
+	bool waitNext(size_t index, Task & task, std::true_type)
+	{
+		bool isSleeping = false;
+		bool isTaken = Parent::getNext(task, [&]() -> bool
+		{
+			return stealNext(index, task);
+		}, [&]() -> int64_t
+		{
+			// pairs with putNext: either the slot is seen full here or the sleeping worker there
+			if (!isSleeping)
+			{
+				++sleepingCount;
+				isSleeping = true;
+			}
+
+			int64_t limit = nextSlotWait(index);
+			if (limit > 0)
+			{
+				--sleepingCount;
+				isSleeping = false;
+			}
+			return limit;
+		});
+
+		if (isSleeping)
+		{
+			--sleepingCount;
+		}
+		return isTaken;
+	}
+
+	// a task spawned by a worker of this pool without strategy arguments runs next on that worker,
+	// unless the strategy orders its tasks
+	template<class... Args>
+	bool isNextSlotUsable(const Args &...) const
+	{
+		return sizeof...(Args) == 0 && Parent::allowsNextTaskSlot() && WaitHelper::current() == this;
+	}
+
+	void putNext(Task & task)
+	{
+		putNext(task, std::integral_constant<bool, Parent::allowsNextTaskSlot()>());
+	}
+
+	void putNext(Task & task, std::false_type)
+	{
+		Parent::post(std::move(task));
+	}
+
+	void putNext(Task & task, std::true_type)
+	{
+		++fullNextSlots;
+		Task displaced;
+		if (nextSlots[current_worker_index()]->put(task, displaced))
+		{
+			--fullNextSlots;
+			Parent::post(std::move(displaced));
+		}
+		else if (sleepingCount.load() > 0)
+		{
+			// the woken worker waits for the task to go stale, unless this one takes it first
+			Parent::wakeIdle();
+		}
+	}
+
+	// wakes producers waiting for room in a bounded pool
+	void taskTaken()
+	{
+		if (waitingProducers.load() > 0)
+		{
+			std::lock_guard<std::mutex> lock(spaceMutex);
+			spaceCondition.notify_all();
+		}
+	}
+
+	void waitForSpace(size_t limit)
+	{
+		backpressure.producerBlocked();
+		std::unique_lock<std::mutex> lock(spaceMutex);
+		++waitingProducers;
+		while (Parent::queueDepth() >= limit && !isClosing)
+		{
+			// the depth of some strategies is approximate, so do not rely on a notification alone
+			spaceCondition.wait_for(lock, std::chrono::milliseconds(1));
+		}
+		--waitingProducers;
+	}
+
+	// Drops the first queued task a bounded runAsync or submit added. Others go back to the queue
+	// with the default strategy arguments: continuations, task group children and timers queued
+	// past the limit have waiters nothing else would release.
+	bool dropNext()
+	{
+		std::vector<Task> kept;
+		bool isDropped = false;
+		Task next;
+		for (size_t count = Parent::queueDepth(); count > 0 && Parent::tryGetNext(next); --count)
+		{
+			if (next.isDroppable())
+			{
+				// destroying the task completes its future with an exception
+				next = Task();
+				isDropped = true;
+				break;
+			}
+			kept.push_back(std::move(next));
+		}
+
+		if (!kept.empty())
+		{
+			Parent::postBulk(kept);
+		}
+		return isDropped;
+	}
+
+	// decides what happens to a new task while the pool is bounded
+	SubmitStatus admit(OverflowPolicy policy)
+	{
+		size_t limit = capacity.load(std::memory_order_relaxed);
+		if (limit == 0)
+		{
+			return SubmitStatus::Queued;
+		}
+
+		if (Parent::queueDepth() >= limit)
+		{
+			// a worker waiting for room might wait for itself
+			if (policy == OverflowPolicy::Block && WaitHelper::current() == this)
+			{
+				policy = OverflowPolicy::CallerRuns;
+			}
+
+			switch (policy)
+			{
+			case OverflowPolicy::Block:
+				waitForSpace(limit);
+				break;
+			case OverflowPolicy::FailFast:
+				backpressure.record(SubmitStatus::Rejected);
+				return SubmitStatus::Rejected;
+			case OverflowPolicy::CallerRuns:
+				backpressure.record(SubmitStatus::RanInCaller);
+				return SubmitStatus::RanInCaller;
+			case OverflowPolicy::DropNext:
+				if (!dropNext())
+				{
+					backpressure.record(SubmitStatus::Rejected);
+					return SubmitStatus::Rejected;
+				}
+				backpressure.taskDropped();
+				break;
+			}
+		}
+
+		backpressure.record(SubmitStatus::Queued);
+		return SubmitStatus::Queued;
+	}
+
+	TimingWheel & timerWheel()
+	{
+		std::call_once(timersOnce, [this]()
+		{
+			timers.reset(new TimingWheel([this](std::vector<Task> & tasks) { Parent::postBulk(tasks); }));
+		});
+		return *timers;
+	}
+
+	void supervise()
+	{
+		std::unique_lock<std::mutex> lock(workersMutex);
+		while (true)
+		{
+			supervisorCondition.wait_for(lock, elastic.sampleInterval);
+			if (isStopping)
+			{
+				break;
+			}
+
+			bool hasProgress = false;
+			bool hasLongIdle = false;
+			size_t idleTicksLimit = static_cast<size_t>(elastic.idleTimeout.count() / elastic.sampleInterval.count());
+			for (auto & slot : slots)
+			{
+				if (slot->thread.joinable() && slot->isFinished)
+				{
+					slot->thread.join();
+				}
+
+				uint64_t progress = slot->progress.load(std::memory_order_relaxed);
+				hasProgress = hasProgress || progress != slot->seenProgress;
+				slot->seenProgress = progress;
+
+				bool isIdle = slot->thread.joinable() && slot->isIdle.load(std::memory_order_relaxed);
+				slot->idleTicks = isIdle ? slot->idleTicks + 1 : 0;
+				hasLongIdle = hasLongIdle || slot->idleTicks > idleTicksLimit;
+			}
+
+			size_t depth = Parent::queueDepth();
+			size_t live = liveCount.load();
+			size_t running = live - std::min(live, blockedCount.load());
+			bool isBacklogged = depth > elastic.backlogPerThread * std::max<size_t>(running, 1);
+			bool isStalled = depth > 0 && !hasProgress;
+
+			if ((isBacklogged || isStalled) && live < elastic.maxThreads)
+			{
+				addWorker();
+			}
+			else if (depth == 0 && hasLongIdle && live > elastic.minThreads && pendingRetires == 0)
+			{
+				// the first idle worker to take it exits
+				++pendingRetires;
+				Parent::post(Task([this]()
+				{
+					--pendingRetires;
+					if (WaitHelper::current() == this)
+					{
+						retireRequested() = true;
+					}
+				}));
+			}
+		}
+	}
+
+public:
+	// extra arguments are passed to the queue strategy
+	template<class... Args>
+	ThreadPool(size_t threadCount = std::thread::hardware_concurrency(), Args &&... args) :
+		Parent(workersCount(threadCount), std::forward<Args>(args)...),
+		fullNextSlots(0),
+		sleepingCount(0),
+		liveCount(0),
+		isStopping(false),
+		statsEnabled(false),
+		traceOrigin(0),
+		tracingEnabled(false),
+		elastic(workersCount(threadCount), workersCount(threadCount)),
+		isElastic(false),
+		blockedCount(0),
+		pendingRetires(0),
+		capacity(0),
+		defaultPolicy(OverflowPolicy::Block),
+		isClosing(false),
+		waitingProducers(0)
+	{
+		start(workersCount(threadCount), workersCount(threadCount), AffinityPolicy::None);
+	}
+
+	// pins the workers to cpus, e.g. ThreadPool(4, AffinityPolicy::Compact)
+	template<class... Args>
+	ThreadPool(size_t threadCount, AffinityPolicy affinity, Args &&... args) :
+		Parent(workersCount(threadCount), std::forward<Args>(args)...),
+		fullNextSlots(0),
+		sleepingCount(0),
+		liveCount(0),
+		isStopping(false),
+		statsEnabled(false),
+		traceOrigin(0),
+		tracingEnabled(false),
+		elastic(workersCount(threadCount), workersCount(threadCount)),
+		isElastic(false),
+		blockedCount(0),
+		pendingRetires(0),
+		capacity(0),
+		defaultPolicy(OverflowPolicy::Block),
+		isClosing(false),
+		waitingProducers(0)
+	{
+		start(workersCount(threadCount), workersCount(threadCount), affinity);
+	}
+
+	// starts elastic.minThreads workers and adapts between the bounds, e.g. ThreadPool(ElasticPolicy(2, 16))
+	template<class... Args>
+	ThreadPool(const ElasticPolicy & elastic, Args &&... args) :
+		Parent(elastic.maxThreads, std::forward<Args>(args)...),
+		fullNextSlots(0),
+		sleepingCount(0),
+		liveCount(0),
+		isStopping(false),
+		statsEnabled(false),
+		traceOrigin(0),
+		tracingEnabled(false),
+		elastic(elastic),
+		isElastic(true),
+		blockedCount(0),
+		pendingRetires(0),
+		capacity(0),
+		defaultPolicy(OverflowPolicy::Block),
+		isClosing(false),
+		waitingProducers(0)
+	{
+		start(elastic.maxThreads, elastic.minThreads, AffinityPolicy::None);
+		supervisor = std::thread(&ThreadPool::supervise, this);
+	}
+
+	~ThreadPool()
+	{
+		timers.reset();
+		close();
+		{
+			std::lock_guard<std::mutex> lock(workersMutex);
+			isStopping = true;
+		}
+		supervisorCondition.notify_all();
+		if (supervisor.joinable())
+		{
+			supervisor.join();
+		}
+
+		for (auto & slot : slots)
+		{
+			if (slot->thread.joinable())
+			{
+				slot->thread.join();
+			}
+		}
+		enableStats(false);
+		enableTracing(false);
+	}
+
+	void close()
+	{
+		isClosing = true;
+		{
+			std::lock_guard<std::mutex> lock(spaceMutex);
+			spaceCondition.notify_all();
+		}
+		Parent::closeQueue();
+	}
+
+	// Limits the number of queued tasks for runAsync, post and submit, 0 removes the limit.
+	// policy applies to runAsync and post, submit takes its own. Bulk and keyed submissions,
+	// timers and postUnbounded are not limited.
+	void setCapacity(size_t maxQueued, OverflowPolicy policy = OverflowPolicy::Block)
+	{
+		defaultPolicy = policy;
+		capacity = maxQueued;
+	}
+
+	BackpressureStats backpressureStats() const
+	{
+		return backpressure.snapshot();
+	}
+
+	// Like runAsync with an explicit policy for a full queue. A rejected task
+	// is not run, its future holds an exception.
+	template<class Fn, class... Args>
+	std::pair<SubmitStatus, Future<typename std::result_of<Fn()>::type>> submit(OverflowPolicy policy, Fn task, Args &&... args)
+	{
+		typedef typename std::result_of<Fn()>::type R;
+
+		SubmitStatus status = admit(policy);
+		Task fn;
+		Future<R> future = make_task(std::move(task), fn);
+		if (status == SubmitStatus::Queued)
+		{
+			fn.allowDrop();
+			Parent::post(std::move(fn), std::forward<Args>(args)...);
+		}
+		else if (status == SubmitStatus::RanInCaller)
+		{
+			fn();
+		}
+		else
+		{
+			future.setException(std::runtime_error("queue is full"));
+		}
+		return std::make_pair(status, future);
+	}
+
+	// extra arguments are passed to the queue strategy
+	template<class Fn, class... Args>
+	Future<typename std::result_of<Fn()>::type> runAsync(Fn task, Args &&... args)
+	{
+		if (capacity.load(std::memory_order_relaxed) != 0)
+		{
+			return submit(defaultPolicy.load(), std::move(task), std::forward<Args>(args)...).second;
+		}
+
+		if (isNextSlotUsable(args...))
+		{
+			Task fn;
+			auto future = make_task(std::move(task), fn);
+			putNext(fn);
+			return future;
+		}
+		return Parent::runAsync(std::move(task), std::forward<Args>(args)...);
+	}
+
+	// a task rejected by a full pool is destroyed without running
+	template<class... Args>
+	void post(Task task, Args &&... args)
+	{
+		if (capacity.load(std::memory_order_relaxed) == 0 && isNextSlotUsable(args...))
+		{
+			putNext(task);
+			return;
+		}
+
+		switch (admit(defaultPolicy.load()))
+		{
+		case SubmitStatus::Queued:
+			Parent::post(std::move(task), std::forward<Args>(args)...);
+			break;
+		case SubmitStatus::RanInCaller:
+			task();
+			break;
+		case SubmitStatus::Rejected:
+			break;
+		}
+	}
+
+	// Posts past setCapacity. Continuations, task groups, task graphs and coroutines use it,
+	// a dropped task of theirs would leave its waiters hanging.
+	void postUnbounded(Task task)
+	{
+		if (isNextSlotUsable())
+		{
+			putNext(task);
+			return;
+		}
+		Parent::post(std::move(task));
+	}
+
+	// Runs fn on a worker once delay has passed. The timer thread hands expired
+	// timers to the queue in batches, no worker sleeps while waiting.
+	template<class Rep, class Period, class Fn>
+	TimerHandle runAfter(std::chrono::duration<Rep, Period> delay, Fn fn)
+	{
+		return timerWheel().add(std::chrono::duration_cast<TimingWheel::Clock::duration>(delay),
+			TimingWheel::Clock::duration::zero(), std::function<void()>(std::move(fn)));
+	}
+
+	// runs fn on a worker every period, starting one period from now, until cancelled
+	template<class Rep, class Period, class Fn>
+	TimerHandle runEvery(std::chrono::duration<Rep, Period> period, Fn fn)
+	{
+		auto interval = std::chrono::duration_cast<TimingWheel::Clock::duration>(period);
+		return timerWheel().add(interval, interval, std::function<void()>(std::move(fn)));
+	}
+
+	// running workers, changes over time in an elastic pool
+	size_t size() const
+	{
+		return liveCount.load();
+	}
+	// Stats are off by default. Counters keep growing while they are on,
+	// tasks created while they are off have no enqueue-to-start latency.
+	void enableStats(bool enable)
+	{
+		if (statsEnabled.exchange(enable) == enable)
+		{
+			return;
+		}
+
+		if (enable)
+		{
+			Task::addTimestampUser();
+		}
+		else
+		{
+			Task::removeTimestampUser();
+		}
+	}
+
+	// Tracing is off by default. While it is on every worker records the tasks it runs,
+	// label them with traced(label, fn). A worker keeps at most eventsPerWorker events,
+	// later ones are dropped.
+	void enableTracing(bool enable, size_t eventsPerWorker = 1 << 16)
+	{
+		if (enable)
+		{
+			std::call_once(tracingOnce, [this, eventsPerWorker]()
+			{
+				for (size_t index = 0; index < slots.size(); ++index)
+				{
+					traceBuffers.emplace_back(new TraceBuffer(eventsPerWorker));
+				}
+				traceOrigin.store(Task::now(), std::memory_order_release);
+			});
+		}
+
+		if (tracingEnabled.exchange(enable) == enable)
+		{
+			return;
+		}
+
+		if (enable)
+		{
+			Task::addTimestampUser();
+		}
+		else
+		{
+			Task::removeTimestampUser();
+		}
+	}
+
+	// Chrome trace JSON of the events recorded so far, open it in ui.perfetto.dev or chrome://tracing.
+	// Workers keep running, events they record meanwhile may be left out.
+	void writeTrace(std::ostream & out) const
+	{
+		int64_t origin = traceOrigin.load(std::memory_order_acquire);
+		if (origin == 0)
+		{
+			write_chrome_trace(out, std::vector<std::unique_ptr<TraceBuffer>>(), origin);
+			return;
+		}
+		write_chrome_trace(out, traceBuffers, origin);
+	}
+
+	// sums the per worker counters, each of them is read without stopping the worker
+	PoolStats stats() const
+	{
+		PoolStats result;
+		result.queueDepth = Parent::queueDepth();
+		for (auto & workerCounters : counters)
+		{
+			result.workers.push_back(workerCounters->snapshot());
+			result.waitLatency += result.workers.back().waitLatency;
+			result.runLatency += result.workers.back().runLatency;
+		}
+		return result;
+	}
+
+	bool helpOnce() override
+	{
+		Task task;
+		bool isWorker = WaitHelper::current() == this;
+		if (!(isWorker && takeNext(current_worker_index(), task)) && !Parent::tryGetNext(task)
+			&& !stealNext(isWorker ? current_worker_index() : SIZE_MAX, task))
+		{
+			return false;
+		}
+		taskTaken();
+
+		runTask(task);
+		return true;
+	}
+
+	// an elastic pool compensates a blocked worker right away unless another one is idle,
+	// extra workers retire after the idle timeout
+	void beginBlocking() override
+	{
+		++blockedCount;
+		// the spawned task must not wait for its blocked worker
+		Task next;
+		if (WaitHelper::current() == this && takeNext(current_worker_index(), next))
+		{
+			Parent::post(std::move(next));
+		}
+
+		if (!isElastic)
+		{
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(workersMutex);
+		for (auto & slot : slots)
+		{
+			if (slot->thread.joinable() && !slot->isFinished && slot->isIdle.load(std::memory_order_relaxed))
+			{
+				return;
+			}
+		}
+		addWorker();
+	}
+
+	void endBlocking() override
+	{
+		--blockedCount;
+	}
+};
+
+template<class T>
+class PriorityQueueStrategy
+{
+private:
+	static const int DEFAULT_PRIORITY = 0;
+
+	struct Lane
+	{
+		PriorityQueue<T> queue;
+		// lets idle workers spin without taking the heap lock
+		LaneDepth depth;
+		IdleWaiter waiter;
+
+		explicit Lane(const IdlePolicy & idlePolicy) :
+			waiter(idlePolicy)
+		{
+		}
+
+		bool tryGet(T & task)
+		{
+			if (depth.get() == 0 || !queue.getMin(task))
+			{
+				return false;
+			}
+
+			depth.removed();
+			return true;
+		}
+	};
+
+	PriorityLanes lanes;
+	size_t workersCount;
+	// only used when lanes.urgentWorkers > 0
+	Lane urgent;
+	Lane shared;
+
+	std::atomic<bool> isClosed;
+
+	Lane & laneFor(int priority)
+	{
+		return lanes.urgentWorkers > 0 && priority <= lanes.urgentThreshold ? urgent : shared;
+	}
+
+	bool isUrgentWorker() const
+	{
+		size_t index = current_worker_index();
+		return index < lanes.urgentWorkers;
+	}
+
+	// shared workers run urgent tasks as well
+	void wake(Lane & lane, size_t count)
+	{
+		lane.waiter.notify(count);
+		if (&lane == &urgent)
+		{
+			shared.waiter.notify(count);
+		}
+	}
+
+	void addTask(T task, int priority)
+	{
+		// counted before the task is visible, so a consumer never takes the depth below zero
+		Lane & lane = laneFor(priority);
+		lane.depth.added(1);
+		lane.queue.add(std::move(task), priority);
+		wake(lane, 1);
+	}
+
+	void addTasks(std::vector<T> & tasks, int priority)
+	{
+		Lane & lane = laneFor(priority);
+		lane.depth.added(tasks.size());
+		for (auto & task : tasks)
+		{
+			lane.queue.add(std::move(task), priority);
+		}
+		wake(lane, tasks.size());
+	}
+
+	static PriorityLanes clamp(PriorityLanes lanes, size_t workersCount)
+	{
+		if (workersCount > 0)
+		{
+			lanes.urgentWorkers = std::min(lanes.urgentWorkers, workersCount - 1);
+		}
+		return lanes;
+	}
+
+public:
+	PriorityQueueStrategy(size_t workersCount = 0, const IdlePolicy & idlePolicy = IdlePolicy()) :
+		workersCount(workersCount),
+		urgent(idlePolicy),
+		shared(idlePolicy),
+		isClosed(false)
+	{
+	}
+
+	PriorityQueueStrategy(size_t workersCount, const PriorityLanes & lanes, const IdlePolicy & idlePolicy = IdlePolicy()) :
+		lanes(clamp(lanes, workersCount)),
+		workersCount(workersCount),
+		urgent(idlePolicy),
+		shared(idlePolicy),
+		isClosed(false)
+	{
+	}
+
+	~PriorityQueueStrategy()
+	{
+		closeQueue();
+	}
+
+	bool getNext(T & task)
+	{
+		Lane & home = isUrgentWorker() ? urgent : shared;
+		return home.waiter.wait([&]() -> bool 
+		{
+			return tryGetNext(task);
+		}, isClosed);
+	}		
+
+	size_t queueDepth() const
+	{
+		return urgent.depth.get() + shared.depth.get();
+	}
+
+	// children would overtake queued urgent tasks and run on urgent-only workers
+	static constexpr bool allowsNextTaskSlot()
+	{
+		return false;
+	}
+
+	PriorityLaneStats laneStats() const
+	{
+		PriorityLaneStats stats;
+		stats.urgent.workersCount = lanes.urgentWorkers;
+		stats.urgent.queueDepth = urgent.depth.get();
+		stats.urgent.maxQueueDepth = urgent.depth.max();
+		stats.shared.workersCount = workersCount - lanes.urgentWorkers;
+		stats.shared.queueDepth = shared.depth.get();
+		stats.shared.maxQueueDepth = shared.depth.max();
+		return stats;
+	}
+
+	bool tryGetNext(T & task)
+	{
+		return urgent.tryGet(task) || (!isUrgentWorker() && shared.tryGet(task));
+	}
+
+	template<class Fn>
+	Future<typename std::result_of<Fn()>::type> runAsync(Fn task, int priority = DEFAULT_PRIORITY)
+	{
+		T fn;
+		auto future = make_task(std::move(task), fn);
+
+		addTask(std::move(fn), priority);
+		return future;
+	}
+
+	void post(T task, int priority = DEFAULT_PRIORITY)
+	{
+		addTask(std::move(task), priority);
+	}
+
+	void postBulk(std::vector<T> & tasks, int priority = DEFAULT_PRIORITY)
+	{
+		addTasks(tasks, priority);
+	}
+
+	template<class InputIt>
+	std::vector<Future<typename BulkResult<InputIt>::type>> runAsyncBulk(InputIt first, InputIt last, int priority = DEFAULT_PRIORITY)
+	{
+		std::vector<T> tasks;
+		auto futures = make_tasks(first, last, tasks);
+
+		addTasks(tasks, priority);
+		return futures;
+	}
+
+	template<class Fn>
+	std::vector<Future<typename std::result_of<Fn(size_t)>::type>> runAsyncRange(size_t count, Fn task, int priority = DEFAULT_PRIORITY)
+	{
+		std::vector<T> tasks;
+		auto futures = make_range_tasks(count, task, tasks);
+
+		addTasks(tasks, priority);
+		return futures;
+	}
+
+	void closeQueue()
+	{
+		isClosed = true;
+		urgent.waiter.notifyAll();
+		shared.waiter.notifyAll();
+	}
+};
+
+// Same interface as PriorityQueueStrategy for priorities in [-LEVELS_COUNT / 2, LEVELS_COUNT / 2),
+// others are clamped. Tasks of one priority run in FIFO order.
+template<class T>
+class BucketPriorityQueueStrategy
+{
+private:
+	static const int DEFAULT_PRIORITY = 0;
+
+	BucketQueue<T> queue;
+
+	// the queue only counts its tasks under every lock
+	std::atomic<size_t> queueSize;
+
+	std::atomic<bool> isClosed;	
+	IdleWaiter waiter;
+
+	static size_t level(int priority)
+	{
+		const int offset = BucketQueue<T>::LEVELS_COUNT / 2;
+		return static_cast<size_t>(std::min(std::max(priority + offset, 0), offset * 2 - 1));
+	}
+
+	void addTask(T task, int priority)
+	{
+		++queueSize;
+		queue.add(std::move(task), level(priority));
+		waiter.notify();
+	}
+
+	void addTasks(std::vector<T> & tasks, int priority)
+	{
+		queueSize += tasks.size();
+		queue.addAll(tasks, level(priority));
+		waiter.notify(tasks.size());
+	}
+
+public:
+	BucketPriorityQueueStrategy(size_t /* workersCount */ = 0, const IdlePolicy & idlePolicy = IdlePolicy()) : 
+		queueSize(0),
+		isClosed(false),
+		waiter(idlePolicy)
+	{
+	}
+
+	~BucketPriorityQueueStrategy()
+	{
+		closeQueue();
+	}
+
+	bool getNext(T & task)
+	{
+		return waiter.wait([&]() -> bool 
+		{
+			return tryGetNext(task);
+		}, isClosed);
+	}		
+
+	size_t queueDepth() const
+	{
+		return queueSize.load(std::memory_order_relaxed);
+	}
+
+	static constexpr bool allowsNextTaskSlot()
+	{
+		return false;
+	}
+
+	bool tryGetNext(T & task)
+	{
+		if (!queue.getMin(task))
+		{
+			return false;
+		}
+
+		--queueSize;
+		return true;
+	}
+
+	template<class Fn>
+	Future<typename std::result_of<Fn()>::type> runAsync(Fn task, int priority = DEFAULT_PRIORITY)
+	{
+		T fn;
+		auto future = make_task(std::move(task), fn);
+
+		addTask(std::move(fn), priority);
+		return future;
+	}
+
+	void post(T task, int priority = DEFAULT_PRIORITY)
+	{
+		addTask(std::move(task), priority);
+	}
+
+	void postBulk(std::vector<T> & tasks, int priority = DEFAULT_PRIORITY)
+	{
+		addTasks(tasks, priority);
+	}
+
+	template<class InputIt>
+	std::vector<Future<typename BulkResult<InputIt>::type>> runAsyncBulk(InputIt first, InputIt last, int priority = DEFAULT_PRIORITY)
+	{
+		std::vector<T> tasks;
+		auto futures = make_tasks(first, last, tasks);
+
+		addTasks(tasks, priority);
+		return futures;
+	}
+
+	template<class Fn>
+	std::vector<Future<typename std::result_of<Fn(size_t)>::type>> runAsyncRange(size_t count, Fn task, int priority = DEFAULT_PRIORITY)
+	{
+		std::vector<T> tasks;
+		auto futures = make_range_tasks(count, task, tasks);
+
+		addTasks(tasks, priority);
+		return futures;
+	}
+
+	void closeQueue()
+	{
+		isClosed = true;
+		waiter.notifyAll();
+	}
+};
+
+// Priorities are followed approximately, see MultiQueue.
+// Quality knobs: more queues per worker scale better, more pop choices give smaller rank errors.
+template<class T>
+class MultiQueueStrategy
+{
+private:
+	static const int DEFAULT_PRIORITY = 0;
+	static const size_t DEFAULT_QUEUES_PER_WORKER = 2;
+	static const size_t DEFAULT_POP_CHOICES = 2;
+
+	MultiQueue<T> queue;
+
+	// the queue only counts its tasks under every lock
+	std::atomic<size_t> queueSize;
+
+	std::atomic<bool> isClosed;	
+	IdleWaiter waiter;
+
+	void addTask(T task, int priority)
+	{
+		++queueSize;
+		queue.add(std::move(task), priority);
+		waiter.notify();
+	}
+
+	void addTasks(std::vector<T> & tasks, int priority)
+	{
+		queueSize += tasks.size();
+		for (auto & task : tasks)
+		{
+			queue.add(std::move(task), priority);
+		}
+		waiter.notify(tasks.size());
+	}
+
+public:
+	MultiQueueStrategy(size_t workersCount = std::thread::hardware_concurrency(), 
+		size_t queuesPerWorker = DEFAULT_QUEUES_PER_WORKER, 
+		size_t popChoices = DEFAULT_POP_CHOICES, 
+		const IdlePolicy & idlePolicy = IdlePolicy()) : 
+		queue(std::max<size_t>(workersCount, 1) * queuesPerWorker, popChoices),
+		queueSize(0),
+		isClosed(false),
+		waiter(idlePolicy)
+	{
+	}
+
+	~MultiQueueStrategy()
+	{
+		closeQueue();
+	}
+
+	bool getNext(T & task)
+	{
+		return waiter.wait([&]() -> bool 
+		{
+			return tryGetNext(task);
+		}, isClosed);
+	}		
+
+	size_t queueDepth() const
+	{
+		return queueSize.load(std::memory_order_relaxed);
+	}
+
+	static constexpr bool allowsNextTaskSlot()
+	{
+		return false;
+	}
+
+	bool tryGetNext(T & task)
+	{
+		if (!queue.getMin(task))
+		{
+			return false;
+		}
+
+		--queueSize;
+		return true;
+	}
+
+	template<class Fn>
+	Future<typename std::result_of<Fn()>::type> runAsync(Fn task, int priority = DEFAULT_PRIORITY)
+	{
+		T fn;
+		auto future = make_task(std::move(task), fn);
+
+		addTask(std::move(fn), priority);
+		return future;
+	}
+
+	void post(T task, int priority = DEFAULT_PRIORITY)
+	{
+		addTask(std::move(task), priority);
+	}
+
+	void postBulk(std::vector<T> & tasks, int priority = DEFAULT_PRIORITY)
+	{
+		addTasks(tasks, priority);
+	}
+
+	template<class InputIt>
+	std::vector<Future<typename BulkResult<InputIt>::type>> runAsyncBulk(InputIt first, InputIt last, int priority = DEFAULT_PRIORITY)
+	{
+		std::vector<T> tasks;
+		auto futures = make_tasks(first, last, tasks);
+
+		addTasks(tasks, priority);
+		return futures;
+	}
+
+	template<class Fn>
+	std::vector<Future<typename std::result_of<Fn(size_t)>::type>> runAsyncRange(size_t count, Fn task, int priority = DEFAULT_PRIORITY)
+	{
+		std::vector<T> tasks;
+		auto futures = make_range_tasks(count, task, tasks);
+
+		addTasks(tasks, priority);
+		return futures;
+	}
+
+	void closeQueue()
+	{
+		isClosed = true;
+		waiter.notifyAll();
+	}
+};
+
+// Earliest deadline first. With aging enabled a task waits at most maxWait
+// before it competes as if its deadline was due, so tasks without a deadline
+// are not starved by a steady stream of urgent ones.
+template<class T>
+class DeadlineQueueStrategy
+{
+private:
+	PriorityQueue<T, int64_t> queue;
+	std::atomic<size_t> queueSize;
+	// 0 disables aging
+	int64_t maxWait;
+	DeadlineCounters counters;
+
+	std::atomic<bool> isClosed;	
+	IdleWaiter waiter;
+
+	int64_t key(Deadline deadline) const
+	{
+		int64_t result = deadline_nanoseconds(deadline);
+		if (maxWait > 0)
+		{
+			result = std::min(result, Task::now() + maxWait);
+		}
+		return result;
+	}
+
+	// counted before the task is visible, so a consumer never takes queueSize below zero
+	void addTask(T task, Deadline deadline)
+	{
+		++queueSize;
+		queue.add(std::move(task), key(deadline));
+		waiter.notify();
+	}
+
+	void addTasks(std::vector<T> & tasks, Deadline deadline)
+	{
+		int64_t taskKey = key(deadline);
+		queueSize += tasks.size();
+		for (auto & task : tasks)
+		{
+			queue.add(std::move(task), taskKey);
+		}
+		waiter.notify(tasks.size());
+	}
+
+	// tasks with a deadline report to the miss counters when they finish
+	template<class Fn>
+	Future<typename std::result_of<Fn()>::type> makeTask(Fn task, Deadline deadline, T & fn)
+	{
+		if (deadline == no_deadline())
+		{
+			return make_task(std::move(task), fn);
+		}
+		return make_task(track_deadline(std::move(task), deadline_nanoseconds(deadline), &counters), fn);
+	}
+
+public:
+	DeadlineQueueStrategy(size_t /* workersCount */ = 0, 
+		std::chrono::nanoseconds maxWait = std::chrono::nanoseconds::zero(), 
+		const IdlePolicy & idlePolicy = IdlePolicy()) : 
+		queueSize(0),
+		maxWait(maxWait.count()),
+		isClosed(false),
+		waiter(idlePolicy)
+	{
+	}
+
+	~DeadlineQueueStrategy()
+	{
+		closeQueue();
+	}
+
+	bool getNext(T & task)
+	{
+		return waiter.wait([&]() -> bool 
+		{
+			return tryGetNext(task);
+		}, isClosed);
+	}		
+
+	size_t queueDepth() const
+	{
+		return queueSize.load(std::memory_order_relaxed);
+	}
+
+	// children without a deadline would overtake earlier deadlines
+	static constexpr bool allowsNextTaskSlot()
+	{
+		return false;
+	}
+
+	bool tryGetNext(T & task)
+	{
+		if (queueSize.load(std::memory_order_relaxed) == 0 || !queue.getMin(task))
+		{
+			return false;
+		}
+
+		--queueSize;
+		return true;
+	}
+
+	DeadlineStats deadlineStats() const
+	{
+		return counters.snapshot();
+	}
+
+	template<class Fn>
+	Future<typename std::result_of<Fn()>::type> runAsync(Fn task, Deadline deadline = no_deadline())
+	{
+		T fn;
+		auto future = makeTask(std::move(task), deadline, fn);
+
+		addTask(std::move(fn), deadline);
+		return future;
+	}
+
+	void post(T task, Deadline deadline = no_deadline())
+	{
+		if (deadline == no_deadline())
+		{
+			addTask(std::move(task), deadline);
+			return;
+		}
+		addTask(T(track_deadline(std::move(task), deadline_nanoseconds(deadline), &counters)), deadline);
+	}
+
+	void postBulk(std::vector<T> & tasks, Deadline deadline = no_deadline())
+	{
+		if (deadline != no_deadline())
+		{
+			for (auto & task : tasks)
+			{
+				task = T(track_deadline(std::move(task), deadline_nanoseconds(deadline), &counters));
+			}
+		}
+		addTasks(tasks, deadline);
+	}
+
+	template<class InputIt>
+	std::vector<Future<typename BulkResult<InputIt>::type>> runAsyncBulk(InputIt first, InputIt last, Deadline deadline = no_deadline())
+	{
+		std::vector<T> tasks;
+		std::vector<Future<typename BulkResult<InputIt>::type>> futures;
+		for (; first != last; ++first)
+		{
+			tasks.emplace_back();
+			futures.push_back(makeTask(*first, deadline, tasks.back()));
+		}
+
+		addTasks(tasks, deadline);
+		return futures;
+	}
+
+	template<class Fn>
+	std::vector<Future<typename std::result_of<Fn(size_t)>::type>> runAsyncRange(size_t count, Fn task, Deadline deadline = no_deadline())
+	{
+		std::vector<T> tasks;
+		auto futures = deadline == no_deadline()
+			? make_range_tasks(count, task, tasks)
+			: make_range_tasks(count, track_deadline(task, deadline_nanoseconds(deadline), &counters), tasks);
+
+		addTasks(tasks, deadline);
+		return futures;
+	}
+
+	void closeQueue()
+	{
+		isClosed = true;
+		waiter.notifyAll();
+	}
+};
+
+template<class T>
+class SimpleQueueStrategy
+{
+private:
+	std::queue<T> queue;
+	// lets idle workers spin without taking the lock
+	std::atomic<size_t> queueSize;
+	
+	std::mutex mutex;
+	std::atomic<bool> isClosed;	
+	IdleWaiter waiter;
+
+	void addTask(T task)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			queue.push(std::move(task));
+			++queueSize;
+		}
+		waiter.notify();
+	}
+
+	void addTasks(std::vector<T> & tasks)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			for (auto & task : tasks)
+			{
+				queue.push(std::move(task));
+			}
+			queueSize += tasks.size();
+		}
+		waiter.notify(tasks.size());
+	}
+
+public:
+	SimpleQueueStrategy(size_t /* workersCount */ = 0, const IdlePolicy & idlePolicy = IdlePolicy()) : 
+		queueSize(0),
+		isClosed(false),
+		waiter(idlePolicy)
+	{
+	}
+
+	~SimpleQueueStrategy()
+	{
+		closeQueue();
+	}
+
+	bool getNext(T & task)
+	{
+		return waiter.wait([&]() -> bool 
+		{
+			return tryGetNext(task);
+		}, isClosed);
+	}	
+
+	template<class TryGet, class ParkLimit>
+	bool getNext(T & task, TryGet tryOther, ParkLimit parkLimit)
+	{
+		return waiter.wait([&]() -> bool
+		{
+			return tryGetNext(task) || tryOther();
+		}, isClosed, parkLimit);
+	}
+
+	void wakeIdle()
+	{
+		waiter.notify();
+	}
+
+	size_t queueDepth() const
+	{
+		return queueSize.load(std::memory_order_relaxed);
+	}
+
+	// several workers already finish queued tasks out of order
+	static constexpr bool allowsNextTaskSlot()
+	{
+		return true;
+	}
+
+	bool tryGetNext(T & task)
+	{
+		if (queueSize.load(std::memory_order_relaxed) == 0)
+		{
+			return false;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (queue.empty())
+		{
+			return false;
+		}
+
+		task = std::move(queue.front());
+		queue.pop();
+		--queueSize;
+		return true;
+	}
+
+	template<class Fn>
+	Future<typename std::result_of<Fn()>::type> runAsync(Fn task)
+	{
+		T fn;
+		auto future = make_task(std::move(task), fn);
+
+		addTask(std::move(fn));
+		return future;
+	}
+
+	void post(T task)
+	{
+		addTask(std::move(task));
+	}
+
+	void postBulk(std::vector<T> & tasks)
+	{
+		addTasks(tasks);
+	}
+
+	template<class InputIt>
+	std::vector<Future<typename BulkResult<InputIt>::type>> runAsyncBulk(InputIt first, InputIt last)
+	{
+		std::vector<T> tasks;
+		auto futures = make_tasks(first, last, tasks);
+
+		addTasks(tasks);
+		return futures;
+	}
+
+	template<class Fn>
+	std::vector<Future<typename std::result_of<Fn(size_t)>::type>> runAsyncRange(size_t count, Fn task)
+	{
+		std::vector<T> tasks;
+		auto futures = make_range_tasks(count, task, tasks);
+
+		addTasks(tasks);
+		return futures;
+	}
+
+	void closeQueue()
+	{
+		isClosed = true;
+		waiter.notifyAll();
+	}
+};
+
+template<class T>
+class WorkStealingQueueStrategy
+{
+private:
+	static const size_t LOCAL_QUEUE_CAPACITY = 1024;
+
+	// how long a lone keyed task waits for its own worker before another one may take it
+	static int64_t affinityGrace()
+	{
+		return 200000;
+	}
+
+	struct WorkerContext
+	{
+		const void * owner;
+		size_t index;
+		unsigned int seed;
+		int cpu;
+	};
+
+	// keyed tasks of one worker, see runAsyncOn
+	struct Mailbox
+	{
+		std::mutex mutex;
+		std::deque<T> tasks;
+		std::atomic<size_t> count;
+		// when the task at the front started waiting
+		std::atomic<int64_t> frontSince;
+		// the owner is in getNext and may be parked
+		std::atomic<bool> isOwnerIdle;
+		char padding[64];
+
+		Mailbox() :
+			count(0),
+			frontSince(0),
+			isOwnerIdle(false)
+		{
+		}
+	};
 
-	void doWork()
+	std::vector<std::unique_ptr<WorkStealingDeque<T>>> queues;
+	std::vector<std::unique_ptr<Mailbox>> mailboxes;
+	// tasks in all mailboxes, incremented before a task is published
+	std::atomic<size_t> mailboxedCount;
+	// cpu each worker is pinned to, -1 if it is not
+	std::unique_ptr<std::atomic<int>[]> workerCpus;
+
+	// tasks from threads outside of the pool and overflow of local queues
+	std::queue<T> injected;
+	std::atomic<size_t> injectedCount;
+
+	std::mutex mutex;
+	std::atomic<bool> isClosed;
+	IdleWaiter waiter;
+
+	static WorkerContext & currentWorker()
 	{
-		while(true)
+		static thread_local WorkerContext context = { nullptr, 0, 0, -1 };
+		return context;
+	}
+
+	WorkerContext & registerWorker()
+	{
+		WorkerContext & context = currentWorker();
+		if (context.owner != this)
+		{
+			context.owner = this;
+			// workers of an elastic pool come and go, the slot index keeps queues unique
+			context.index = current_worker_index();
+			context.seed = static_cast<unsigned int>(context.index) * 2654435761u + 1;
+			context.cpu = current_thread_cpu();
+			workerCpus[context.index] = context.cpu;
+		}
+		return context;
+	}
+
+	size_t randomVictim(WorkerContext & context)
+	{
+		// xorshift
+		context.seed ^= context.seed << 13;
+		context.seed ^= context.seed >> 17;
+		context.seed ^= context.seed << 5;
+		return context.seed % queues.size();
+	}
+
+	bool popInjected(T & task)
+	{
+		if (injectedCount.load(std::memory_order_relaxed) == 0)
+		{
+			return false;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+		if (injected.empty())
+		{
+			return false;
+		}
+
+		task = std::move(injected.front());
+		injected.pop();
+		--injectedCount;
+		return true;
+	}
+
+	bool popMailbox(size_t index, T & task)
+	{
+		Mailbox & mailbox = *mailboxes[index];
+		if (mailbox.count.load(std::memory_order_relaxed) == 0)
+		{
+			return false;
+		}
+
+		std::unique_lock<std::mutex> lock(mailbox.mutex);
+		if (mailbox.tasks.empty())
+		{
+			return false;
+		}
+
+		task = std::move(mailbox.tasks.front());
+		mailbox.tasks.pop_front();
+		--mailbox.count;
+		--mailboxedCount;
+		mailbox.frontSince.store(Task::now(), std::memory_order_relaxed);
+		return true;
+	}
+
+	// Keyed tasks of other workers are only taken under imbalance: from the back of a mailbox
+	// that holds more than one task, or a lone task its worker has not picked up in time.
+	bool stealMailbox(WorkerContext & context, T & task)
+	{
+		size_t start = randomVictim(context);
+		for (size_t offset = 0; offset < mailboxes.size(); ++offset)
 		{
-			auto task = Parent::getNext();
-			if (!task)
+			size_t victim = (start + offset) % mailboxes.size();
+			Mailbox & mailbox = *mailboxes[victim];
+			size_t count = mailbox.count.load(std::memory_order_relaxed);
+			if (victim == context.index || count == 0)
 			{
-				break;
+				continue;
+			}
+
+			bool isStale = isClosed.load(std::memory_order_relaxed)
+				|| Task::now() - mailbox.frontSince.load(std::memory_order_relaxed) > affinityGrace();
+			if (count == 1 && !isStale)
+			{
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(mailbox.mutex);
+			if (mailbox.tasks.size() > 1)
+			{
+				task = std::move(mailbox.tasks.back());
+				mailbox.tasks.pop_back();
+			}
+			else if (!mailbox.tasks.empty() && isStale)
+			{
+				task = std::move(mailbox.tasks.front());
+				mailbox.tasks.pop_front();
+				mailbox.frontSince.store(Task::now(), std::memory_order_relaxed);
+			}
+			else
+			{
+				continue;
 			}
 
-			(*task)();
+			--mailbox.count;
+			--mailboxedCount;
+			return true;
 		}
+		return false;
 	}
 
-public:
-	ThreadPool()
+	// victims at most maxDistance away in the cpu topology
+	bool steal(WorkerContext & context, T & task, int maxDistance)
 	{
-		unsigned int core_count = std::thread::hardware_concurrency();
-		for(size_t index = 0; index < core_count; ++index)
+		const CpuTopology & topology = CpuTopology::system();
+		size_t start = randomVictim(context);
+		for (size_t offset = 0; offset < queues.size(); ++offset)
 		{
-			workers.emplace_back(&ThreadPool::doWork, this);
+			size_t victim = (start + offset) % queues.size();
+			if (victim == context.index)
+			{
+				continue;
+			}
+
+			if (maxDistance < CpuTopology::REMOTE 
+				&& topology.distance(context.cpu, workerCpus[victim].load(std::memory_order_relaxed)) > maxDistance)
+			{
+				continue;
+			}
+
+			if (queues[victim]->steal(task))
+			{
+				return true;
+			}
 		}
+		return false;
 	}
 
-	~ThreadPool()
+	// pinned workers try their own package before going remote
+	bool steal(WorkerContext & context, T & task)
 	{
-		close();
-		for(auto & it : workers)
+		bool isStolen = (context.cpu >= 0 && steal(context, task, CpuTopology::SAME_PACKAGE))
+			|| steal(context, task, CpuTopology::REMOTE)
+			|| stealMailbox(context, task);
+
+		WorkerCounters * counters = WorkerCounters::current();
+		if (counters && context.index < queues.size())
 		{
-			it.join();
+			if (isStolen)
+			{
+				counters->stealSucceeded();
+			}
+			else
+			{
+				counters->stealFailed();
+			}
 		}
+		return isStolen;
 	}
 
-	void close()
+	bool findTask(WorkerContext & context, T & task)
 	{
-		Parent::closeQueue();
+		return queues[context.index]->pop(task) 
+			|| popMailbox(context.index, task)
+			|| popInjected(task) 
+			|| steal(context, task);
 	}
-};
 
-template<class T, class Fn> 
-std::function<void()> make_func(Future<T> future, Fn task)
-{
-	return [=]() mutable 
-	{ 
-		try
+	void addTask(T & task)
+	{
+		WorkerContext & context = currentWorker();
+		if (context.owner != this || !queues[context.index]->push(task))
 		{
-			future.set(task()); 
+			std::unique_lock<std::mutex> lock(mutex);
+			injected.push(std::move(task));
+			++injectedCount;
 		}
-		catch(const std::exception & e)
+
+		waiter.notify();
+	}
+
+	void addKeyedTask(size_t key, T & task)
+	{
+		size_t index = key % mailboxes.size();
+		Mailbox & mailbox = *mailboxes[index];
+		++mailboxedCount;
 		{
-			future.setException(e);
+			std::unique_lock<std::mutex> lock(mailbox.mutex);
+			if (mailbox.tasks.empty())
+			{
+				mailbox.frontSince.store(Task::now(), std::memory_order_relaxed);
+			}
+			mailbox.tasks.push_back(std::move(task));
+			++mailbox.count;
 		}
-	};
-}
 
-template<class Fn>
-std::function<void()> make_func(Future<void> future, Fn task)
-{
-	return [=]() mutable 
-	{ 
-		try
+		// A busy owner checks its mailbox after the current task, one woken peer polls in case
+		// that takes long. A parked owner cannot be woken alone.
+		if (mailbox.isOwnerIdle.load())
 		{
-			task(); 
-			future.set(); 
+			waiter.notifyAll();
 		}
-		catch(const std::exception & e)
+		else
 		{
-			future.setException(e);
+			waiter.notify();
 		}
-	};
-}
+	}
 
-template<class T>
-class PriorityQueueStrategy
-{
-private:
-	static const int DEFAULT_PRIORITY = 0;
+	// nanoseconds until a keyed task of another worker may be stolen, 0 if no mailbox holds one
+	int64_t mailboxWait(const WorkerContext & context) const
+	{
+		if (mailboxedCount.load() == 0)
+		{
+			return 0;
+		}
 
-	PriorityQueue<T> queue;
+		// a task that is being added is not visible yet
+		int64_t result = affinityGrace();
+		int64_t now = Task::now();
+		for (size_t victim = 0; victim < mailboxes.size(); ++victim)
+		{
+			const Mailbox & mailbox = *mailboxes[victim];
+			size_t count = mailbox.count.load(std::memory_order_relaxed);
+			if (victim == context.index || count == 0)
+			{
+				continue;
+			}
 
-	std::mutex mutex;
-	std::condition_variable condition;
-	bool isClosed;	
+			int64_t staleIn = count > 1 ? 0 : mailbox.frontSince.load(std::memory_order_relaxed) + affinityGrace() + 1 - now;
+			result = std::min(result, std::max<int64_t>(staleIn, 1));
+		}
+		return result;
+	}
 
-	void addTask(const T & task, int priority)
+	// A lone keyed task of a busy worker becomes stealable after the grace period and nothing
+	// wakes the idle workers then, so they park for at most the time until it does.
+	template<class TryGet, class ParkLimit>
+	bool waitTask(WorkerContext & context, T & task, TryGet tryOther, ParkLimit parkLimit)
 	{
-		std::unique_lock<std::mutex> lock(mutex);
-		queue.add(task, priority);
-		condition.notify_one();
+		return waiter.wait([&]() -> bool
+		{
+			return findTask(context, task) || tryOther();
+		}, isClosed, [&]() -> int64_t
+		{
+			int64_t limit = mailboxWait(context);
+			int64_t otherLimit = parkLimit();
+			return limit == 0 || (otherLimit > 0 && otherLimit < limit) ? otherLimit : limit;
+		});
+	}
+
+	void addTasks(std::vector<T> & tasks)
+	{
+		WorkerContext & context = currentWorker();
+		auto first = tasks.begin();
+		if (context.owner == this)
+		{
+			while (first != tasks.end() && queues[context.index]->push(*first))
+			{
+				++first;
+			}
+		}
+
+		if (first != tasks.end())
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			for (; first != tasks.end(); ++first)
+			{
+				injected.push(std::move(*first));
+				++injectedCount;
+			}
+		}
+
+		waiter.notify(tasks.size());
 	}
 
 public:
-	PriorityQueueStrategy() : 
-		isClosed(false)
+	WorkStealingQueueStrategy(size_t workersCount = std::thread::hardware_concurrency(), const IdlePolicy & idlePolicy = IdlePolicy()) :
+		mailboxedCount(0),
+		workerCpus(new std::atomic<int>[std::max<size_t>(workersCount, 1)]),
+		injectedCount(0),
+		isClosed(false),
+		waiter(idlePolicy)
 	{
+		for (size_t index = 0; index < std::max<size_t>(workersCount, 1); ++index)
+		{
+			workerCpus[index] = -1;
+			queues.emplace_back(new WorkStealingDeque<T>(LOCAL_QUEUE_CAPACITY));
+			mailboxes.emplace_back(new Mailbox());
+		}
 	}
 
-	~PriorityQueueStrategy()
+	~WorkStealingQueueStrategy()
 	{
 		closeQueue();
 	}
 
-	std::shared_ptr<T> getNext()
+	bool getNext(T & task)
 	{
-		while(true)
+		return getNext(task, []() -> bool { return false; }, []() -> int64_t { return 0; });
+	}
+
+	template<class TryGet, class ParkLimit>
+	bool getNext(T & task, TryGet tryOther, ParkLimit parkLimit)
+	{
+		WorkerContext & context = registerWorker();
+		Mailbox & mailbox = *mailboxes[context.index];
+		mailbox.isOwnerIdle.store(true);
+		bool isTaken = waitTask(context, task, tryOther, parkLimit);
+		mailbox.isOwnerIdle.store(false, std::memory_order_relaxed);
+		return isTaken;
+	}
+
+	void wakeIdle()
+	{
+		waiter.notify();
+	}
+
+	void attachWorker()
+	{
+		registerWorker();
+	}
+
+	size_t queueDepth() const
+	{
+		size_t result = injectedCount.load(std::memory_order_relaxed);
+		for (size_t index = 0; index < queues.size(); ++index)
 		{
-			std::unique_lock<std::mutex> lock(mutex);
-			condition.wait(lock, [this]() -> bool 
-			{
-				return !queue.empty() || isClosed;
-			});
+			result += queues[index]->size() + mailboxes[index]->count.load(std::memory_order_relaxed);
+		}
+		return result;
+	}
 
-			lock.unlock();
-			if (!queue.empty())
-			{
-				auto ptr = queue.getMin();
-				if (ptr)
-				{
-					return ptr;
-				}
-			}
-			
-			if (isClosed)
-			{
-				break;
-			}
+	// an owner pops its own deque newest first already
+	static constexpr bool allowsNextTaskSlot()
+	{
+		return true;
+	}
+
+	// tasks from threads outside of the pool and overflow of full local queues
+	size_t injectedDepth() const
+	{
+		return injectedCount.load(std::memory_order_relaxed);
+	}
+
+	// threads outside of the pool may call it too, they only take injected or stolen tasks
+	bool tryGetNext(T & task)
+	{
+		WorkerContext & context = currentWorker();
+		if (context.owner == this)
+		{
+			return findTask(context, task);
 		}
-		
-		return std::shared_ptr<T>();
-	}		
 
+		WorkerContext outsider = { this, queues.size(), static_cast<unsigned int>(reinterpret_cast<uintptr_t>(&task)) | 1, -1 };
+		return popInjected(task) || steal(outsider, task);
+	}
+
+	// Tasks with the same key run on the same worker while the load is balanced, so data
+	// they share (a matrix tile, a shard) stays in its cache. Not limited by ThreadPool::setCapacity.
 	template<class Fn>
-	Future<typename std::result_of<Fn()>::type> runAsync(Fn task, int priority = DEFAULT_PRIORITY)
+	Future<typename std::result_of<Fn()>::type> runAsyncOn(size_t key, Fn task)
+	{
+		T fn;
+		auto future = make_task(std::move(task), fn);
+
+		addKeyedTask(key, fn);
+		return future;
+	}
+
+	void postOn(size_t key, T task)
+	{
+		addKeyedTask(key, task);
+	}
+
+	// tasks added from a worker of this pool go to its own queue, others are injected
+	template<class Fn>
+	Future<typename std::result_of<Fn()>::type> runAsync(Fn task)
 	{
-		Future<typename std::result_of<Fn()>::type> future;
-		auto fn = make_func(future, task);
+		T fn;
+		auto future = make_task(std::move(task), fn);
 
-		addTask(fn, priority);
+		addTask(fn);
 		return future;
 	}
 
+	void post(T task)
+	{
+		addTask(task);
+	}
+
+	void postBulk(std::vector<T> & tasks)
+	{
+		addTasks(tasks);
+	}
+
+	template<class InputIt>
+	std::vector<Future<typename BulkResult<InputIt>::type>> runAsyncBulk(InputIt first, InputIt last)
+	{
+		std::vector<T> tasks;
+		auto futures = make_tasks(first, last, tasks);
+
+		addTasks(tasks);
+		return futures;
+	}
+
+	template<class Fn>
+	std::vector<Future<typename std::result_of<Fn(size_t)>::type>> runAsyncRange(size_t count, Fn task)
+	{
+		std::vector<T> tasks;
+		auto futures = make_range_tasks(count, task, tasks);
+
+		addTasks(tasks);
+		return futures;
+	}
+
 	void closeQueue()
 	{
-		std::unique_lock<std::mutex> lock(mutex);
 		isClosed = true;
-		condition.notify_all();
+		waiter.notifyAll();
 	}
 };
 
 template<class T>
-class SimpleQueueStrategy
+class RingBufferQueueStrategy
 {
 private:
-	std::queue<std::shared_ptr<T>> queue;
-	
-	std::mutex mutex;
-	std::condition_variable condition;
-	bool isClosed;	
+	static const size_t DEFAULT_CAPACITY = 4096;
 
-	void addTask(const T & task)
+	RingBuffer<T> queue;
+	IdleWaiter notEmpty;
+	EventCount notFull;
+	std::atomic<bool> isClosed;
+
+	// buffer is full, wait for consumers. A worker thread runs queued tasks meanwhile,
+	// it may be the only consumer left.
+	void pushWhenFree(T & task)
 	{
-		std::unique_lock<std::mutex> lock(mutex);
-		queue.push(std::make_shared<T>(task));
-		condition.notify_one();
+		WaitHelper * helper = WaitHelper::current();
+		while (true)
+		{
+			if (helper && helper->helpOnce())
+			{
+				if (queue.push(task))
+				{
+					break;
+				}
+				continue;
+			}
+
+			auto key = notFull.prepareWait();
+			if (queue.push(task))
+			{
+				notFull.cancelWait();
+				break;
+			}
+			notFull.wait(key);
+		}
+	}
+
+	void addTask(T & task)
+	{
+		if (!queue.push(task))
+		{
+			pushWhenFree(task);
+		}
+
+		notEmpty.notify();
+	}
+
+	void addTasks(std::vector<T> & tasks)
+	{
+		size_t notifiedCount = 0;
+		for (size_t index = 0; index < tasks.size(); ++index)
+		{
+			if (queue.push(tasks[index]))
+			{
+				continue;
+			}
+
+			// wake consumers for everything pushed so far before waiting for space
+			notEmpty.notify(index - notifiedCount);
+			notifiedCount = index;
+			pushWhenFree(tasks[index]);
+		}
+
+		notEmpty.notify(tasks.size() - notifiedCount);
 	}
 
 public:
-	SimpleQueueStrategy() : 
+	RingBufferQueueStrategy(size_t /* workersCount */ = 0, size_t capacity = DEFAULT_CAPACITY, const IdlePolicy & idlePolicy = IdlePolicy()) :
+		queue(capacity),
+		notEmpty(idlePolicy),
 		isClosed(false)
 	{
 	}
 
-	~SimpleQueueStrategy()
+	~RingBufferQueueStrategy()
 	{
 		closeQueue();
 	}
 
-	std::shared_ptr<T> getNext()
+	bool getNext(T & task)
 	{
-		std::unique_lock<std::mutex> lock(mutex);
-		condition.wait(lock, [this]() -> bool 
+		if (!notEmpty.wait([&]() -> bool { return queue.pop(task); }, isClosed))
 		{
-			return !queue.empty() || isClosed;
-		});
+			return false;
+		}
+
+		notFull.notify();
+		return true;
+	}
+
+	template<class TryGet, class ParkLimit>
+	bool getNext(T & task, TryGet tryOther, ParkLimit parkLimit)
+	{
+		bool isPopped = false;
+		if (!notEmpty.wait([&]() -> bool { return (isPopped = queue.pop(task)) || tryOther(); }, isClosed, parkLimit))
+		{
+			return false;
+		}
 
-		if (!queue.empty())
+		if (isPopped)
 		{
-			auto ptr = queue.front();
-			queue.pop();
-			return ptr;
+			notFull.notify();
 		}
-		
-		return std::shared_ptr<T>();
-	}	
+		return true;
+	}
+
+	void wakeIdle()
+	{
+		notEmpty.notify();
+	}
+
+	size_t queueDepth() const
+	{
+		return queue.size();
+	}
+
+	static constexpr bool allowsNextTaskSlot()
+	{
+		return true;
+	}
+
+	bool tryGetNext(T & task)
+	{
+		if (!queue.pop(task))
+		{
+			return false;
+		}
+
+		notFull.notify();
+		return true;
+	}
 
 	template<class Fn>
-	Future<typename std::result_of<Fn()>::type> runAsync(Fn & task)
+	Future<typename std::result_of<Fn()>::type> runAsync(Fn task)
 	{
-		Future<typename std::result_of<Fn()>::type> future;
-		auto fn = make_func(future, task);
+		T fn;
+		auto future = make_task(std::move(task), fn);
 
 		addTask(fn);
 		return future;
 	}
 
+	void post(T task)
+	{
+		addTask(task);
+	}
+
+	void postBulk(std::vector<T> & tasks)
+	{
+		addTasks(tasks);
+	}
+
+	template<class InputIt>
+	std::vector<Future<typename BulkResult<InputIt>::type>> runAsyncBulk(InputIt first, InputIt last)
+	{
+		std::vector<T> tasks;
+		auto futures = make_tasks(first, last, tasks);
+
+		addTasks(tasks);
+		return futures;
+	}
+
+	template<class Fn>
+	std::vector<Future<typename std::result_of<Fn(size_t)>::type>> runAsyncRange(size_t count, Fn task)
+	{
+		std::vector<T> tasks;
+		auto futures = make_range_tasks(count, task, tasks);
+
+		addTasks(tasks);
+		return futures;
+	}
+
 	void closeQueue()
 	{
-		std::unique_lock<std::mutex> lock(mutex);
 		isClosed = true;
-		condition.notify_all();
+		notEmpty.notifyAll();
 	}
 };
 
 
 typedef ThreadPool<SimpleQueueStrategy> SimpleThreadPool;
-typedef ThreadPool<PriorityQueueStrategy> PriorityThreadPool;
\ No newline at end of file
+typedef ThreadPool<PriorityQueueStrategy> PriorityThreadPool;
+typedef ThreadPool<BucketPriorityQueueStrategy> BucketPriorityThreadPool;
+typedef ThreadPool<MultiQueueStrategy> MultiQueueThreadPool;
+typedef ThreadPool<DeadlineQueueStrategy> DeadlineThreadPool;
+typedef ThreadPool<WorkStealingQueueStrategy> WorkStealingThreadPool;
+typedef ThreadPool<RingBufferQueueStrategy> RingBufferThreadPool;
+
+typedef WorkStealingThreadPool DefaultThreadPool;
+
+// Process-wide pool shared by the parallel algorithms. It is created on first use,
+// so repeated calls reuse warm threads instead of spawning and joining their own.
+inline DefaultThreadPool & defaultThreadPool()
+{
+	static DefaultThreadPool pool;
+	return pool;
+}
@@ -19,186 +19,272 @@
 #define D(a) ;
 #endif
 
-template<class T>
+// Concurrent heap of Hunt et al.: a short global lock only reserves the slot,
+// add sifts up with hand-over-hand node locks while getMin sifts down.
+// A node inserted by a thread is tagged with its id until it settles,
+// so the inserter can follow it when a concurrent getMin moves it.
+// Smaller priorities come first.
+template<class T, class Priority = int>
 class PriorityQueue
 {
 private:
-	struct QueueItem
-	{
-		std::shared_ptr<T> item;
-		int priority;
+	static const size_t EMPTY = 0;
+	static const size_t AVAILABLE = 1;
+	static const size_t MAX_LEVELS = 48;
+	static const size_t DEFAULT_CAPACITY = 1024;
 
-		QueueItem(const T & item, int priority)
-		{
-			this->item = std::make_shared<T>(item);
-			this->priority = priority;
-		}
+	typedef boost::detail::spinlock SpinLock;
 
-		bool operator<(const QueueItem & other) const
+	struct Node
+	{
+		SpinLock lock;
+		size_t tag;
+		Priority priority;
+		T item;
+
+		Node() :
+			lock(),
+			tag(EMPTY),
+			priority()
 		{
-			return priority < other.priority;
 		}
 	};
 
-	typedef boost::detail::spinlock SpinLock;
-
-	std::vector<std::pair<QueueItem, SpinLock>> heap;
-	mutable boost::shared_mutex readWriteLock;
+	// level k holds nodes [2^k, 2^(k+1)), levels are never moved once allocated
+	std::atomic<Node *> levels[MAX_LEVELS];
+	std::atomic<size_t> levelsCount;
 
-	typedef boost::shared_lock<boost::shared_mutex> ReadLock;
-	typedef boost::unique_lock<boost::shared_mutex> WriteLock;
+	std::mutex heapLock;
+	std::atomic<size_t> count;
 
-	std::unique_lock<SpinLock> getLock(size_t index, bool isDefer = false)
+	static size_t levelOf(size_t index)
 	{
-		if (isDefer)
-		{
-			return std::unique_lock<boost::detail::spinlock>(heap[index].second, std::defer_lock);
-		}
-		else
+#if defined(__GNUC__) || defined(__clang__)
+		return sizeof(unsigned long long) * 8 - 1 - __builtin_clzll(index);
+#else
+		size_t level = 0;
+		while (index >>= 1)
 		{
-			return std::unique_lock<boost::detail::spinlock>(heap[index].second);
+			++level;
 		}
+		return level;
+#endif
 	}
 
-	size_t min(size_t first, size_t second) const
+	// indices start at 1
+	Node & node(size_t index)
 	{
-		if (heap[first].first < heap[second].first)
-		{
-			return first;
-		}
-
-		return second;
+		size_t level = levelOf(index);
+		return levels[level].load(std::memory_order_acquire)[index - (size_t(1) << level)];
 	}
 
-	bool compareAndSwap(size_t first, size_t second)
+	bool exists(size_t index) const
 	{
-		if (heap[second].first < heap[first].first)
-		{
-			std::swap(heap[first].first, heap[second].first);
-			return true;
-		}
-		return false;
+		return levelOf(index) < levelsCount.load(std::memory_order_acquire);
 	}
 
-	void siftDown(size_t index, std::unique_lock<SpinLock> currentLock)
+	// must be called with heapLock held
+	void reserve(size_t index)
 	{
-		ReadLock lock(readWriteLock);
-		if (index >= size())
+		while (!exists(index))
 		{
-			return;
+			size_t level = levelsCount.load(std::memory_order_relaxed);
+			levels[level].store(new Node[size_t(1) << level], std::memory_order_release);
+			levelsCount.store(level + 1, std::memory_order_release);
 		}
+	}
 
-		size_t left = 2 * index + 1;
-		size_t right = 2 * index + 2;
+	static size_t currentTag()
+	{
+		static std::atomic<size_t> nextTag(AVAILABLE + 1);
+		static thread_local size_t tag = nextTag++;
+		return tag;
+	}
 
-		if (size() < right)
-		{
-			// we have no children
-			return;
-		}
+	static void swapNodes(Node & first, Node & second)
+	{
+		std::swap(first.item, second.item);
+		std::swap(first.priority, second.priority);
+		std::swap(first.tag, second.tag);
+	}
 
-		if (size() > right)
+	void siftUp(size_t index, size_t tag)
+	{
+		while (index > 1)
 		{
-			// two children
-			auto leftLock = getLock(left, true);
-			auto rightLock = getLock(right, true);
-
-			D("locking " << left << " and " << right);
-			D("size = " << size());
-			std::lock(leftLock, rightLock);
+			size_t parentIndex = index / 2;
+			Node & parent = node(parentIndex);
+			Node & current = node(index);
+			std::unique_lock<SpinLock> parentLock(parent.lock);
+			std::unique_lock<SpinLock> currentLock(current.lock);
 
-			int swapIndex = min(left, right);
-			if (compareAndSwap(index, swapIndex))
+			if (parent.tag == AVAILABLE && current.tag == tag)
 			{
-				currentLock.unlock();
-				if (swapIndex == left)
+				if (current.priority < parent.priority)
 				{
-					rightLock.unlock();
-					siftDown(left, std::move(leftLock));
+					swapNodes(current, parent);
+					index = parentIndex;
 				}
 				else
 				{
-					leftLock.unlock();
-					siftDown(right, std::move(rightLock));
+					current.tag = AVAILABLE;
+					return;
 				}
 			}
-		}
-		else
-		{
-			// one child
-			auto leftLock = getLock(left);
-			if (compareAndSwap(index, left))
+			else if (parent.tag == EMPTY)
 			{
+				// our item was moved to the root by getMin, which sifts it down
+				return;
+			}
+			else if (current.tag != tag)
+			{
+				// getMin moved our item up
+				index = parentIndex;
+			}
+			else
+			{
+				// the parent is still being inserted by another thread, let it finish
 				currentLock.unlock();
-				siftDown(left, std::move(leftLock));
+				parentLock.unlock();
+				std::this_thread::yield();
 			}
 		}
+
+		Node & root = node(1);
+		std::lock_guard<SpinLock> rootLock(root.lock);
+		if (root.tag == tag)
+		{
+			root.tag = AVAILABLE;
+		}
 	}
 
-	void siftUp(size_t index)
+	void siftDown(size_t index, std::unique_lock<SpinLock> currentLock)
 	{
-		if (index > 0)
+		while (exists(2 * index + 1))
 		{
-			size_t parent = (index - 1) / 2;
+			size_t leftIndex = 2 * index;
+			size_t rightIndex = 2 * index + 1;
+			Node & left = node(leftIndex);
+			Node & right = node(rightIndex);
+			std::unique_lock<SpinLock> leftLock(left.lock);
+			std::unique_lock<SpinLock> rightLock(right.lock);
+
+			if (left.tag == EMPTY)
+			{
+				return;
+			}
+
+			size_t childIndex = leftIndex;
+			if (right.tag != EMPTY && right.priority < left.priority)
+			{
+				childIndex = rightIndex;
+				leftLock.unlock();
+			}
+			else
+			{
+				rightLock.unlock();
+			}
 
-			if (compareAndSwap(parent, index))
+			Node & child = node(childIndex);
+			Node & current = node(index);
+			if (!(child.priority < current.priority))
 			{
-				siftUp(parent);
+				return;
 			}
+
+			D("moving " << index << " down to " << childIndex);
+			swapNodes(child, current);
+			currentLock = std::move(childIndex == leftIndex ? leftLock : rightLock);
+			index = childIndex;
 		}
 	}
 
 public:
-	std::shared_ptr<T> getMin()
+	explicit PriorityQueue(size_t capacity = DEFAULT_CAPACITY) :
+		levelsCount(0),
+		count(0)
 	{
-		boost::upgrade_lock<boost::shared_mutex> lock(readWriteLock);
-		std::shared_ptr<T> result;		
-
-		if (size() == 0)
+		for (auto & level : levels)
 		{
-			return std::shared_ptr<T>();
+			level = nullptr;
 		}
+		reserve(std::max<size_t>(capacity, 1));
+	}
 
-		auto topLock = getLock(0); 
+	PriorityQueue(const PriorityQueue &) = delete;
+	PriorityQueue & operator=(const PriorityQueue &) = delete;
 
-		if (size() == 1)
+	~PriorityQueue()
+	{
+		for (size_t level = 0; level < levelsCount; ++level)
 		{
-			boost::upgrade_to_unique_lock<boost::shared_mutex> uniqueLock(lock);
-			result = heap.front().first.item;
-			heap.pop_back();
-			return result;
+			delete[] levels[level].load();
 		}
+	}
 
+	bool getMin(T & result)
+	{
+		std::unique_lock<std::mutex> lock(heapLock);
+		size_t bottomIndex = count.load(std::memory_order_relaxed);
+		if (bottomIndex == 0)
 		{
-			boost::upgrade_to_unique_lock<boost::shared_mutex> uniqueLock(lock);
-			result = heap.front().first.item;
-			auto lastLock = getLock(size() - 1);
-			std::swap(heap.front().first, heap.back().first);
-			lastLock.unlock();
-			heap.pop_back();
+			return false;
 		}
 
+		count.store(bottomIndex - 1);
+		Node & bottom = node(bottomIndex);
+		std::unique_lock<SpinLock> bottomLock(bottom.lock);
 		lock.unlock();
-		siftDown(0, std::move(topLock));
-		return result;
+
+		T item = std::move(bottom.item);
+		Priority priority = bottom.priority;
+		bottom.tag = EMPTY;
+		bottomLock.unlock();
+
+		Node & root = node(1);
+		std::unique_lock<SpinLock> rootLock(root.lock);
+		if (root.tag == EMPTY)
+		{
+			// the bottom was the root
+			result = std::move(item);
+			return true;
+		}
+
+		result = std::move(root.item);
+		root.item = std::move(item);
+		root.priority = priority;
+		root.tag = AVAILABLE;
+		siftDown(1, std::move(rootLock));
+		return true;
 	}
 
-	void add(const T & task, int priority)
+	void add(T task, Priority priority)
 	{
-		WriteLock lock(readWriteLock);
-		heap.emplace_back(QueueItem(task, priority), SpinLock());
-		size_t lastIndex = size() - 1;
-		siftUp(lastIndex);
+		size_t tag = currentTag();
+
+		std::unique_lock<std::mutex> lock(heapLock);
+		size_t index = count.load(std::memory_order_relaxed) + 1;
+		reserve(index);
+		count.store(index);
+		Node & target = node(index);
+		std::unique_lock<SpinLock> targetLock(target.lock);
+		lock.unlock();
+
+		target.item = std::move(task);
+		target.priority = priority;
+		target.tag = tag;
+		targetLock.unlock();
+
+		siftUp(index, tag);
 	}
 
 	bool empty() const
 	{
-		ReadLock lock(readWriteLock);
-		return heap.size() == 0;
+		return count.load() == 0;
 	}
 
 	size_t size() const
 	{
-		return heap.size();
+		return count.load();
 	}
-};
\ No newline at end of file
+};
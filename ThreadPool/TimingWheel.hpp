@@ -0,0 +1,316 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+
+#include "Task.hpp"
+#include "BucketQueue.hpp"
+
+// one pending call of runAfter or runEvery, shared by the wheel and the posted tasks
+struct TimerEntry
+{
+	std::function<void()> fn;
+	uint64_t expiresAt;
+	// 0 for one-shot timers
+	uint64_t periodTicks;
+	std::atomic<bool> isCancelled;
+
+	TimerEntry(std::function<void()> fn, uint64_t expiresAt, uint64_t periodTicks) :
+		fn(std::move(fn)),
+		expiresAt(expiresAt),
+		periodTicks(periodTicks),
+		isCancelled(false)
+	{
+	}
+};
+
+// Returned by runAfter and runEvery. Cancelling stops future runs,
+// a run that has already been handed to the workers still happens.
+class TimerHandle
+{
+private:
+	std::shared_ptr<TimerEntry> entry;
+
+public:
+	TimerHandle()
+	{
+	}
+
+	explicit TimerHandle(std::shared_ptr<TimerEntry> entry) :
+		entry(std::move(entry))
+	{
+	}
+
+	void cancel()
+	{
+		if (entry)
+		{
+			entry->isCancelled.store(true, std::memory_order_relaxed);
+		}
+	}
+};
+
+// Hierarchical timing wheel with 1ms ticks: level k has SLOTS_COUNT slots of SLOTS_COUNT^k ticks,
+// a timer sits in the level that matches how far away it is and moves down a level when
+// its slot comes round. Insertion and expiry are O(1). One thread advances the wheel and hands
+// every batch of expired timers to dispatch in a single call. It sleeps until the next
+// occupied slot instead of waking up every tick.
+class TimingWheel
+{
+public:
+	typedef std::chrono::steady_clock Clock;
+	typedef std::chrono::milliseconds Tick;
+
+private:
+	static const size_t LEVEL_BITS = 6;
+	static const size_t SLOTS_COUNT = 1 << LEVEL_BITS;
+	static const size_t LEVELS_COUNT = 4;
+
+	typedef std::vector<std::shared_ptr<TimerEntry>> Slot;
+
+	Slot slots[LEVELS_COUNT][SLOTS_COUNT];
+	// bit per non-empty slot
+	uint64_t occupied[LEVELS_COUNT];
+	// expired before the wheel got to them
+	Slot due;
+	size_t timersCount;
+
+	// ticks up to and including this one are processed
+	uint64_t currentTick;
+	Clock::time_point origin;
+
+	std::function<void(std::vector<Task> &)> dispatch;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool isStopping;
+	std::thread thread;
+
+	static uint64_t levelShift(size_t level)
+	{
+		return level * LEVEL_BITS;
+	}
+
+	// the tick that ends at or after time, so a timer never fires early
+	uint64_t tickAt(Clock::time_point time) const
+	{
+		Tick::rep ticks = std::chrono::duration_cast<Tick>(time - origin).count();
+		return ticks < 0 ? 0 : static_cast<uint64_t>(ticks) + (origin + Tick(ticks) < time ? 1 : 0);
+	}
+
+	// the last tick that has fully passed
+	uint64_t elapsedTicks() const
+	{
+		return static_cast<uint64_t>(std::chrono::duration_cast<Tick>(Clock::now() - origin).count());
+	}
+
+	void insert(std::shared_ptr<TimerEntry> entry)
+	{
+		++timersCount;
+		if (entry->expiresAt <= currentTick)
+		{
+			due.push_back(std::move(entry));
+			return;
+		}
+
+		// the farthest level takes everything beyond its range and re-sorts it on the way down
+		uint64_t delta = entry->expiresAt - currentTick;
+		size_t level = 0;
+		while (level + 1 < LEVELS_COUNT && delta >= (uint64_t(1) << levelShift(level + 1)))
+		{
+			++level;
+		}
+		uint64_t expiresAt = std::min(entry->expiresAt, currentTick + (uint64_t(1) << levelShift(LEVELS_COUNT)) - 1);
+		size_t index = (expiresAt >> levelShift(level)) & (SLOTS_COUNT - 1);
+
+		slots[level][index].push_back(std::move(entry));
+		occupied[level] |= uint64_t(1) << index;
+	}
+
+	Slot takeSlot(size_t level, size_t index)
+	{
+		Slot result;
+		result.swap(slots[level][index]);
+		occupied[level] &= ~(uint64_t(1) << index);
+		timersCount -= result.size();
+		return result;
+	}
+
+	// processes the next tick, collects the timers that expire at it into expired
+	void advance(Slot & expired)
+	{
+		++currentTick;
+
+		// a level is cascaded when all levels below it wrap around, the highest one first
+		size_t level = 0;
+		while (level + 1 < LEVELS_COUNT && (currentTick & ((uint64_t(1) << levelShift(level + 1)) - 1)) == 0)
+		{
+			++level;
+		}
+		for (; level > 0; --level)
+		{
+			Slot cascaded = takeSlot(level, (currentTick >> levelShift(level)) & (SLOTS_COUNT - 1));
+			for (auto & entry : cascaded)
+			{
+				insert(std::move(entry));
+			}
+		}
+
+		Slot current = takeSlot(0, currentTick & (SLOTS_COUNT - 1));
+		for (auto & entry : current)
+		{
+			expired.push_back(std::move(entry));
+		}
+	}
+
+	// the next tick at which advance has work to do, or none if the wheel is empty
+	bool nextEventTick(uint64_t & tick) const
+	{
+		if (!due.empty())
+		{
+			tick = currentTick;
+			return true;
+		}
+		if (timersCount == 0)
+		{
+			return false;
+		}
+
+		// the level 0 slots are scanned in order starting after the current one
+		tick = ((currentTick >> LEVEL_BITS) + 1) << LEVEL_BITS;
+		size_t start = (currentTick + 1) & (SLOTS_COUNT - 1);
+		uint64_t rotated = start == 0 ? occupied[0] : (occupied[0] >> start) | (occupied[0] << (SLOTS_COUNT - start));
+		if (rotated)
+		{
+			tick = std::min<uint64_t>(tick, currentTick + 1 + count_trailing_zeros(rotated));
+		}
+		return true;
+	}
+
+	// hands the expired timers to the workers, re-arms the periodic ones
+	void collect(Slot & expired, std::vector<Task> & batch)
+	{
+		for (auto & entry : expired)
+		{
+			if (entry->isCancelled.load(std::memory_order_relaxed))
+			{
+				continue;
+			}
+
+			if (entry->periodTicks == 0)
+			{
+				batch.push_back(Task([entry]() { entry->fn(); }));
+				continue;
+			}
+
+			// fixed rate, a run that outlasts the period overlaps with the next one
+			batch.push_back(Task([entry]()
+			{
+				if (!entry->isCancelled.load(std::memory_order_relaxed))
+				{
+					entry->fn();
+				}
+			}));
+			entry->expiresAt = std::max(entry->expiresAt + entry->periodTicks, currentTick + 1);
+			insert(std::move(entry));
+		}
+		expired.clear();
+	}
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		Slot expired;
+		std::vector<Task> batch;
+		while (!isStopping)
+		{
+			uint64_t nowTick = elapsedTicks();
+			expired.swap(due);
+			timersCount -= expired.size();
+			while (currentTick < nowTick)
+			{
+				advance(expired);
+			}
+			collect(expired, batch);
+
+			if (!batch.empty())
+			{
+				lock.unlock();
+				dispatch(batch);
+				batch.clear();
+				lock.lock();
+				continue;
+			}
+
+			uint64_t tick;
+			if (!nextEventTick(tick))
+			{
+				condition.wait(lock);
+			}
+			else if (tick > currentTick)
+			{
+				condition.wait_until(lock, origin + Tick(tick));
+			}
+		}
+	}
+
+public:
+	// dispatch is called on the timer thread with every batch of expired tasks
+	explicit TimingWheel(std::function<void(std::vector<Task> &)> dispatch) :
+		timersCount(0),
+		currentTick(0),
+		origin(Clock::now()),
+		dispatch(std::move(dispatch)),
+		isStopping(false)
+	{
+		std::fill(occupied, occupied + LEVELS_COUNT, 0);
+		thread = std::thread(&TimingWheel::run, this);
+	}
+
+	TimingWheel(const TimingWheel &) = delete;
+	TimingWheel & operator=(const TimingWheel &) = delete;
+
+	// timers that have not expired yet are dropped
+	~TimingWheel()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			isStopping = true;
+		}
+		condition.notify_all();
+		thread.join();
+	}
+
+	// period is zero for a one-shot timer
+	TimerHandle add(Clock::duration delay, Clock::duration period, std::function<void()> fn)
+	{
+		uint64_t periodTicks = 0;
+		if (period > Clock::duration::zero())
+		{
+			periodTicks = std::max<uint64_t>(std::chrono::duration_cast<Tick>(period + Tick(1) - Clock::duration(1)).count(), 1);
+		}
+
+		std::shared_ptr<TimerEntry> entry;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			entry = std::make_shared<TimerEntry>(std::move(fn), tickAt(Clock::now() + delay), periodTicks);
+			insert(entry);
+		}
+		// the timer thread may sleep past the new expiry
+		condition.notify_one();
+		return TimerHandle(entry);
+	}
+
+	// pending timers, periodic ones count until cancelled
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return timersCount;
+	}
+};
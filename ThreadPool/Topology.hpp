@@ -0,0 +1,206 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// How workers are pinned to cpus:
+// Compact fills the hyperthreads of one core, then the cores of one package, then the next package;
+// Scatter puts consecutive workers on different packages, then on different cores.
+enum class AffinityPolicy
+{
+	None,
+	Compact,
+	Scatter
+};
+
+// cpus this process may run on, read from /sys/devices/system/cpu
+class CpuTopology
+{
+private:
+	struct Cpu
+	{
+		int id;
+		int core;
+		int package;
+		// position of the core inside its package and of the cpu inside its core
+		int coreIndex;
+		int siblingIndex;
+	};
+
+	std::vector<Cpu> cpus;
+	// indexed by cpu id
+	std::vector<int> cores;
+	std::vector<int> packages;
+
+	static int readValue(int cpu, const char * name, int fallback)
+	{
+		std::ostringstream path;
+		path << "/sys/devices/system/cpu/cpu" << cpu << "/topology/" << name;
+		std::ifstream file(path.str());
+		int value;
+		return file >> value ? value : fallback;
+	}
+
+	static std::vector<int> usableCpus()
+	{
+		std::vector<int> result;
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		{
+			for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			{
+				if (CPU_ISSET(cpu, &set))
+				{
+					result.push_back(cpu);
+				}
+			}
+		}
+#endif
+		if (result.empty())
+		{
+			for (unsigned cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); ++cpu)
+			{
+				result.push_back(cpu);
+			}
+		}
+		return result;
+	}
+
+	CpuTopology()
+	{
+		for (int id : usableCpus())
+		{
+			Cpu cpu = { id, readValue(id, "core_id", id), readValue(id, "physical_package_id", 0), 0, 0 };
+			cpus.push_back(cpu);
+		}
+
+		std::sort(cpus.begin(), cpus.end(), [](const Cpu & first, const Cpu & second)
+		{
+			return std::make_pair(first.package, std::make_pair(first.core, first.id))
+				< std::make_pair(second.package, std::make_pair(second.core, second.id));
+		});
+
+		for (size_t index = 1; index < cpus.size(); ++index)
+		{
+			Cpu & previous = cpus[index - 1];
+			Cpu & cpu = cpus[index];
+			if (cpu.package != previous.package)
+			{
+				continue;
+			}
+
+			if (cpu.core == previous.core)
+			{
+				cpu.coreIndex = previous.coreIndex;
+				cpu.siblingIndex = previous.siblingIndex + 1;
+			}
+			else
+			{
+				cpu.coreIndex = previous.coreIndex + 1;
+			}
+		}
+
+		int maxId = 0;
+		for (auto & cpu : cpus)
+		{
+			maxId = std::max(maxId, cpu.id);
+		}
+
+		cores.assign(maxId + 1, -1);
+		packages.assign(maxId + 1, -1);
+		for (auto & cpu : cpus)
+		{
+			cores[cpu.id] = cpu.core;
+			packages[cpu.id] = cpu.package;
+		}
+	}
+
+public:
+	static const int SAME_CORE = 0;
+	static const int SAME_PACKAGE = 1;
+	static const int REMOTE = 2;
+
+	static const CpuTopology & system()
+	{
+		static CpuTopology topology;
+		return topology;
+	}
+
+	size_t size() const
+	{
+		return cpus.size();
+	}
+
+	// cpu ids for count workers, wraps around when there are more workers than cpus
+	std::vector<int> placement(AffinityPolicy policy, size_t count) const
+	{
+		std::vector<int> result;
+		if (policy == AffinityPolicy::None)
+		{
+			return result;
+		}
+
+		std::vector<Cpu> order(cpus);
+		if (policy == AffinityPolicy::Scatter)
+		{
+			std::stable_sort(order.begin(), order.end(), [](const Cpu & first, const Cpu & second)
+			{
+				return std::make_pair(first.siblingIndex, first.coreIndex)
+					< std::make_pair(second.siblingIndex, second.coreIndex);
+			});
+		}
+
+		for (size_t index = 0; index < count; ++index)
+		{
+			result.push_back(order[index % order.size()].id);
+		}
+		return result;
+	}
+
+	// SAME_CORE for hyperthreads of one core, SAME_PACKAGE for one socket, REMOTE otherwise
+	int distance(int first, int second) const
+	{
+		if (first < 0 || second < 0 || first >= (int)cores.size() || second >= (int)cores.size())
+		{
+			return REMOTE;
+		}
+
+		if (packages[first] != packages[second])
+		{
+			return REMOTE;
+		}
+		return cores[first] == cores[second] ? SAME_CORE : SAME_PACKAGE;
+	}
+};
+
+// cpu the current thread is pinned to, -1 if it is not
+inline int & current_thread_cpu()
+{
+	static thread_local int cpu = -1;
+	return cpu;
+}
+
+inline bool pin_current_thread(int cpu)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0)
+	{
+		current_thread_cpu() = cpu;
+		return true;
+	}
+#endif
+	return false;
+}